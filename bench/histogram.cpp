@@ -0,0 +1,79 @@
+#include "histogram.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <stdexcept>
+
+using namespace bench;
+
+histogram::histogram(unsigned sub_bucket_bits) : sub_bits(sub_bucket_bits) {
+  if (sub_bits < 2 || sub_bits > 16)
+    throw std::invalid_argument("histogram precision out of range");
+
+  // exact values up to 2^sub_bits, then half as many buckets for each of
+  //  the remaining powers of two
+  buckets.resize((66 - sub_bits) << (sub_bits - 1));
+}
+
+void histogram::record(std::uint64_t value, std::uint64_t count) {
+  buckets[index_of(value)] += count;
+
+  total += count;
+  lowest = std::min(lowest, value);
+  highest = std::max(highest, value);
+  sum += static_cast<long double>(value) * count;
+}
+
+void histogram::merge(const histogram &other) {
+  if (other.sub_bits != sub_bits)
+    throw std::invalid_argument("merging histograms of different precision");
+
+  for (std::size_t i = 0; i < buckets.size(); ++i)
+    buckets[i] += other.buckets[i];
+
+  total += other.total;
+  lowest = std::min(lowest, other.lowest);
+  highest = std::max(highest, other.highest);
+  sum += other.sum;
+}
+
+double histogram::mean() const {
+  return total == 0 ? 0.0 : static_cast<double>(sum / total);
+}
+
+std::uint64_t histogram::value_at(double percentile) const {
+  if (total == 0)
+    return 0;
+
+  percentile = std::clamp(percentile, 0.0, 100.0);
+  auto target = std::max<std::uint64_t>(
+      1, static_cast<std::uint64_t>(std::ceil(percentile / 100 * total)));
+
+  std::uint64_t seen = 0;
+  for (std::size_t i = 0; i < buckets.size(); ++i) {
+    seen += buckets[i];
+    if (seen >= target)
+      return std::clamp(highest_in(i), min(), highest);
+  }
+
+  return highest;
+}
+
+std::size_t histogram::index_of(std::uint64_t value) const {
+  if (value >> sub_bits == 0)
+    return value;
+
+  // keep the top sub_bits bits of the value, shift says how many were dropped
+  unsigned shift = std::bit_width(value) - sub_bits;
+  return (static_cast<std::size_t>(shift) << (sub_bits - 1)) + (value >> shift);
+}
+
+std::uint64_t histogram::highest_in(std::size_t index) const {
+  if (index >> sub_bits == 0)
+    return index;
+
+  unsigned shift = (index >> (sub_bits - 1)) - 1;
+  std::uint64_t top = index - (static_cast<std::size_t>(shift) << (sub_bits - 1));
+  return ((top + 1) << shift) - 1;
+}
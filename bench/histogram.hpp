@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace bench {
+/*
+HDR-style histogram of non-negative integers (latencies in nanoseconds)
+
+values below 2^sub_bucket_bits are counted exactly, bigger ones fall into
+log-linear buckets: every power of two is split into 2^(sub_bucket_bits - 1)
+equal buckets, so a reported value is within 1 / 2^(sub_bucket_bits - 1)
+of the recorded one (0.8% for the default) over the whole 64-bit range
+
+recording is a couple of instructions and never allocates, histograms of
+different threads are combined with merge()
+*/
+class histogram {
+public:
+  explicit histogram(unsigned sub_bucket_bits = 8);
+
+  void record(std::uint64_t value, std::uint64_t count = 1);
+  void merge(const histogram &other);
+
+  std::uint64_t count() const { return total; }
+  std::uint64_t min() const { return total == 0 ? 0 : lowest; }
+  std::uint64_t max() const { return highest; }
+  double mean() const;
+
+  // smallest value that percentile (0-100) of the recorded values do not
+  //  exceed (rounded up to the end of its bucket, but never above max())
+  std::uint64_t value_at(double percentile) const;
+
+private:
+  std::size_t index_of(std::uint64_t value) const;
+  std::uint64_t highest_in(std::size_t index) const;
+
+  unsigned sub_bits;
+  std::vector<std::uint64_t> buckets;
+
+  std::uint64_t total = 0;
+  std::uint64_t lowest = UINT64_MAX;
+  std::uint64_t highest = 0;
+  long double sum = 0;
+};
+} // namespace bench
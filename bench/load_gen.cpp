@@ -0,0 +1,674 @@
+// HTTP/1.1 load generator for the webservers (runs over loopback against a
+//  docroot it generates itself)
+//
+// closed loop (default): every connection keeps --pipeline requests in
+//  flight and sends the next one as soon as a response arrives
+// open loop (--rate): requests are due at a constant rate no matter how fast
+//  the server answers and their latency counts from the time they were due,
+//  so a stalled server shows up in the tail instead of slowing the generator
+//  down (coordinated omission)
+
+#include "histogram.hpp"
+#include "io.hpp"
+#include "io_engine.hpp"
+#include "request_parser.hpp"
+#include "utils.hpp"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace {
+using clock_type = std::chrono::steady_clock;
+using namespace std::chrono_literals;
+
+struct file_spec {
+  std::size_t size;
+  unsigned weight; // relative share of the requests
+};
+
+struct options {
+  std::uint16_t port = 8080;
+  unsigned connections = 16;
+  unsigned threads = 1;
+  unsigned pipeline = 1;
+  bool keep_alive = true;
+  double rate = 0; // requests per second of all connections, 0: closed loop
+  std::chrono::duration<double> duration = 10s;
+  std::vector<file_spec> mix{{1 << 10, 50}, {16 << 10, 30}, {256 << 10, 15},
+                             {1 << 20, 5}};
+  std::filesystem::path docroot; // empty: temporary directory
+  bool generate_only = false;
+  coro::io_engine::backend backend = coro::io_engine::backend::io_uring;
+  std::vector<std::string> server; // started on the docroot if not empty
+};
+
+void print_usage(const char *name) {
+  std::cerr << "Usage: " << name << " [OPTIONS] [-- <server> [server options]]\n";
+  std::cerr << "Options:\n";
+  std::cerr << "  --port <n>: port of the server on 127.0.0.1 (default: 8080)\n";
+  std::cerr << "  --connections <n>: concurrent connections (default: 16)\n";
+  std::cerr << "  --threads <n>: event loops the connections are split between (default: 1)\n";
+  std::cerr << "  --duration <s>: length of the run (default: 10)\n";
+  std::cerr << "  --rate <req/s>: open loop at this total rate (default: 0, closed loop)\n";
+  std::cerr << "  --pipeline <n>: requests in flight on a connection (default: 1)\n";
+  std::cerr << "  --close: send Connection: close and open a connection per request\n";
+  std::cerr << "  --mix <size:weight,...>: file sizes (k/m suffixes) and their share of the requests\n";
+  std::cerr << "                           (default: 1k:50,16k:30,256k:15,1m:5)\n";
+  std::cerr << "  --docroot <dir>: generate the files there and keep them (default: temporary)\n";
+  std::cerr << "  --generate-only: only generate the docroot\n";
+  std::cerr << "  --backend <poll|epoll|io_uring>: select io_engine backend (default: io_uring)\n";
+  std::cerr << "the server is started as <server> <port> <docroot> [server options] and\n";
+  std::cerr << "stopped after the run, without one the server must already serve the docroot\n";
+}
+
+template <typename T> T parse_number(std::string_view text, const char *what) {
+  T value{};
+  auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+  if (ec != std::errc() || end != text.data() + text.size())
+    throw std::invalid_argument(std::string("Invalid ") + what);
+
+  return value;
+}
+
+// bytes with an optional k or m (binary) suffix
+std::size_t parse_size(std::string_view text) {
+  std::size_t unit = 1;
+  if (text.ends_with('k') || text.ends_with('K'))
+    unit = 1 << 10;
+  else if (text.ends_with('m') || text.ends_with('M'))
+    unit = 1 << 20;
+
+  if (unit != 1)
+    text.remove_suffix(1);
+
+  return parse_number<std::size_t>(text, "file size") * unit;
+}
+
+std::vector<file_spec> parse_mix(std::string_view text) {
+  std::vector<file_spec> res;
+
+  while (!text.empty()) {
+    auto item = text.substr(0, text.find(','));
+    text.remove_prefix(std::min(text.size(), item.size() + 1));
+
+    auto colon = item.find(':');
+    file_spec file{parse_size(item.substr(0, colon)), 1};
+    if (colon != std::string_view::npos)
+      file.weight = parse_number<unsigned>(item.substr(colon + 1), "weight");
+
+    if (file.weight > 0)
+      res.push_back(file);
+  }
+
+  if (res.empty())
+    throw std::invalid_argument("Empty file mix");
+
+  return res;
+}
+
+options parse_options(int argc, char *argv[]) {
+  options res;
+
+  auto value_of = [&](int &i) -> std::string_view {
+    if (i + 1 >= argc) {
+      std::cerr << argv[i] << " requires an argument\n";
+      throw std::invalid_argument("Missing option argument");
+    }
+
+    return argv[++i];
+  };
+
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg = argv[i];
+    if (arg == "--") {
+      res.server.assign(argv + i + 1, argv + argc);
+      if (res.server.empty())
+        throw std::invalid_argument("Missing server after --");
+      break;
+    } else if (arg == "--port") {
+      res.port = parse_number<std::uint16_t>(value_of(i), "port");
+    } else if (arg == "--connections") {
+      res.connections = parse_number<unsigned>(value_of(i), "connection count");
+    } else if (arg == "--threads") {
+      res.threads = parse_number<unsigned>(value_of(i), "thread count");
+    } else if (arg == "--duration") {
+      res.duration = std::chrono::duration<double>(
+          parse_number<double>(value_of(i), "duration"));
+    } else if (arg == "--rate") {
+      res.rate = parse_number<double>(value_of(i), "rate");
+    } else if (arg == "--pipeline") {
+      res.pipeline = parse_number<unsigned>(value_of(i), "pipeline depth");
+    } else if (arg == "--close") {
+      res.keep_alive = false;
+    } else if (arg == "--mix") {
+      res.mix = parse_mix(value_of(i));
+    } else if (arg == "--docroot") {
+      res.docroot = value_of(i);
+    } else if (arg == "--generate-only") {
+      res.generate_only = true;
+    } else if (arg == "--backend") {
+      res.backend = coro::backend_from_string(value_of(i));
+    } else {
+      print_usage(argv[0]);
+      throw std::invalid_argument("Unknown option");
+    }
+  }
+
+  if (res.connections == 0 || res.threads == 0 || res.pipeline == 0 ||
+      res.duration <= 0s || res.rate < 0)
+    throw std::invalid_argument("Counts, duration and rate must be positive");
+  if (res.generate_only && res.docroot.empty())
+    throw std::invalid_argument("--generate-only needs --docroot");
+
+  res.threads = std::min(res.threads, res.connections);
+  return res;
+}
+
+std::string file_name(std::size_t size) { return std::to_string(size) + ".bin"; }
+
+// random (incompressible) files of the mix in the "localhost" host directory
+void generate_docroot(const std::filesystem::path &docroot,
+                      const std::vector<file_spec> &mix) {
+  auto host = docroot / "localhost";
+  std::filesystem::create_directories(host);
+
+  for (const auto &file : mix) {
+    std::ofstream out(host / file_name(file.size),
+                      std::ios::binary | std::ios::trunc);
+    std::mt19937_64 rng(file.size);
+
+    std::vector<std::uint64_t> chunk(8192);
+    for (std::size_t left = file.size; left > 0;) {
+      std::ranges::generate(chunk, rng);
+
+      std::size_t count = std::min(left, chunk.size() * sizeof(chunk[0]));
+      out.write(reinterpret_cast<const char *>(chunk.data()), count);
+      left -= count;
+    }
+
+    if (!out.flush())
+      throw std::runtime_error("Cannot write the docroot");
+  }
+}
+
+// generated docroot that is removed with the object (unless it was asked for)
+class docroot_dir {
+public:
+  explicit docroot_dir(std::filesystem::path dir) : dir(std::move(dir)) {
+    if (this->dir.empty()) {
+      std::string name = "/tmp/load_gen.XXXXXX";
+      if (!mkdtemp(name.data()))
+        utils::throw_sys_error("mkdtemp");
+      this->dir = name;
+      temporary = true;
+    }
+  }
+  docroot_dir(const docroot_dir &) = delete;
+  docroot_dir &operator=(const docroot_dir &) = delete;
+
+  ~docroot_dir() {
+    std::error_code ec;
+    if (temporary)
+      std::filesystem::remove_all(dir, ec);
+  }
+
+  const std::filesystem::path &path() const { return dir; }
+
+private:
+  std::filesystem::path dir;
+  bool temporary = false;
+};
+
+// server started on the docroot, stopped (SIGTERM) with the object
+class server_process {
+public:
+  server_process(const std::vector<std::string> &command, std::uint16_t port,
+                 const std::filesystem::path &docroot) {
+    std::vector<std::string> args{command[0], std::to_string(port), docroot};
+    args.insert(args.end(), command.begin() + 1, command.end());
+
+    std::vector<char *> argv;
+    for (auto &arg : args)
+      argv.push_back(arg.data());
+    argv.push_back(nullptr);
+
+    pid = fork();
+    if (pid == -1)
+      utils::throw_sys_error("fork");
+
+    if (pid == 0) {
+      // keep the report readable, errors still go to stderr
+      int null = open("/dev/null", O_WRONLY);
+      if (null != -1)
+        dup2(null, STDOUT_FILENO);
+
+      execv(argv[0], argv.data());
+      std::perror("execv");
+      _exit(127);
+    }
+  }
+  server_process(const server_process &) = delete;
+  server_process &operator=(const server_process &) = delete;
+
+  ~server_process() {
+    if (running())
+      kill(pid, SIGTERM);
+    waitpid(pid, nullptr, 0);
+  }
+
+  bool running() {
+    if (exited)
+      return false;
+
+    exited = waitpid(pid, nullptr, WNOHANG) == pid;
+    return !exited;
+  }
+
+private:
+  pid_t pid = -1;
+  bool exited = false;
+};
+
+sockaddr_in loopback(std::uint16_t port) {
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  return addr;
+}
+
+// blocking connects until the server accepts one (it may still be starting)
+void wait_for_server(const sockaddr_in &addr, server_process *server) {
+  auto deadline = clock_type::now() + 5s;
+
+  while (true) {
+    utils::handle sock(socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    if (!sock)
+      utils::throw_sys_error("socket");
+
+    if (connect(sock, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) == 0)
+      return;
+
+    if (server && !server->running())
+      throw std::runtime_error("The server exited");
+    if (clock_type::now() >= deadline)
+      throw std::runtime_error("The server does not accept connections");
+
+    std::this_thread::sleep_for(10ms);
+  }
+}
+
+// shared by all connections (read-only while they run)
+struct workload {
+  sockaddr_in address;
+  std::vector<std::string> requests; // one per file of the mix
+  std::discrete_distribution<std::size_t> pick;
+  unsigned connections;
+  std::size_t depth;             // requests in flight on a connection
+  bool keep_alive;
+  clock_type::duration interval; // between requests of a connection (open loop)
+  clock_type::time_point start;
+  clock_type::time_point end;
+};
+
+struct results {
+  bench::histogram latency; // nanoseconds
+  std::uint64_t responses = 0;
+  std::uint64_t non_2xx = 0;
+  std::uint64_t lost = 0;       // sent, but the connection failed before the response
+  std::uint64_t unfinished = 0; // still in flight at the end of the run
+  std::uint64_t connects = 0;
+  std::uint64_t failed_connects = 0;
+  std::uint64_t bytes = 0; // of responses (heads included)
+
+  void merge(const results &other) {
+    latency.merge(other.latency);
+    responses += other.responses;
+    non_2xx += other.non_2xx;
+    lost += other.lost;
+    unfinished += other.unfinished;
+    connects += other.connects;
+    failed_connects += other.failed_connects;
+    bytes += other.bytes;
+  }
+};
+
+struct response_head {
+  int status = 0;
+  std::size_t content_length = 0;
+  bool close = false;
+};
+
+// status and the headers the generator needs, nullopt if the head is
+//  malformed or has no Content-Length (the servers always send one)
+std::optional<response_head> parse_head(std::string_view head) {
+  if (!head.starts_with("HTTP/1.") || head.size() < 12 || head[8] != ' ')
+    return std::nullopt;
+
+  response_head res;
+  auto [end, ec] = std::from_chars(head.data() + 9, head.data() + 12, res.status);
+  if (ec != std::errc() || end != head.data() + 12)
+    return std::nullopt;
+
+  bool has_length = false;
+  for (std::size_t pos = head.find("\r\n") + 2; pos < head.size();) {
+    std::size_t eol = head.find("\r\n", pos);
+    if (eol == std::string_view::npos || eol == pos)
+      break;
+
+    auto line = head.substr(pos, eol - pos);
+    pos = eol + 2;
+
+    auto colon = line.find(':');
+    if (colon == std::string_view::npos)
+      return std::nullopt;
+
+    auto name = line.substr(0, colon);
+    auto value = line.substr(colon + 1);
+    while (!value.empty() && value.front() == ' ')
+      value.remove_prefix(1);
+
+    if (http::equal_ignoring_case(name, "Content-Length")) {
+      auto [at, err] = std::from_chars(value.data(), value.data() + value.size(),
+                                       res.content_length);
+      has_length = err == std::errc();
+    } else if (http::equal_ignoring_case(name, "Connection")) {
+      res.close = http::equal_ignoring_case(value, "close");
+    }
+  }
+
+  if (!has_length)
+    return std::nullopt;
+
+  return res;
+}
+
+coro::eager_task<utils::handle> connect_to(coro::io_engine &engine,
+                                           const sockaddr_in &addr,
+                                           clock_type::time_point deadline) {
+  utils::handle sock(socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0));
+  if (!sock)
+    co_return utils::handle();
+
+  // pipelined requests are small, do not hold them back
+  int one = 1;
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  if (connect(sock, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) == 0)
+    co_return std::move(sock);
+  if (errno != EINPROGRESS)
+    co_return utils::handle();
+
+  auto ready = co_await engine.try_poll_until(sock, POLLOUT, deadline);
+
+  int error = 0;
+  socklen_t length = sizeof(error);
+  if (!ready || *ready == 0 ||
+      getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &length) == -1 || error != 0)
+    co_return utils::handle();
+
+  co_return std::move(sock);
+}
+
+coro::task run_connection(coro::io_engine &engine, const workload &load,
+                          unsigned id, results &res) {
+  std::mt19937 rng(id);
+  auto pick = load.pick;
+
+  const bool open_loop = load.interval != clock_type::duration::zero();
+
+  // spread the first requests of the connections over one interval
+  auto due = load.start + load.interval * id / load.connections;
+
+  utils::handle sock;
+  std::vector<std::byte> buffer(64 << 10);
+  std::size_t filled = 0;
+
+  // start (closed loop) or due (open loop) times of the requests in flight
+  std::deque<clock_type::time_point> in_flight;
+
+  // head of the response whose body is being read
+  std::optional<response_head> current;
+  std::size_t body_left = 0;
+
+  auto drop_connection = [&] {
+    res.lost += in_flight.size();
+    in_flight.clear();
+    sock = utils::handle();
+    filled = 0;
+    current.reset();
+  };
+
+  while (true) {
+    auto now = clock_type::now();
+    if (now >= load.end)
+      break;
+
+    if (!sock) {
+      sock = co_await connect_to(engine, load.address, load.end);
+      if (!sock) {
+        // do not spin on a refusing server
+        ++res.failed_connects;
+        co_await engine.wait_until(std::min(clock_type::now() + 10ms, load.end));
+        continue;
+      }
+
+      ++res.connects;
+    }
+
+    // send every request that is due and fits into the pipeline at once
+    std::string batch;
+    while (in_flight.size() < load.depth && (!open_loop || due <= now)) {
+      batch += load.requests[pick(rng)];
+      in_flight.push_back(open_loop ? due : now);
+      due += load.interval;
+    }
+
+    if (!batch.empty() && co_await io::send_all(engine, sock, std::string_view(batch))) {
+      drop_connection();
+      continue;
+    }
+
+    if (in_flight.empty()) {
+      // open loop, nothing is due yet
+      co_await engine.wait_until(std::min(due, load.end));
+      continue;
+    }
+
+    auto wake = load.end;
+    if (open_loop && in_flight.size() < load.depth)
+      wake = std::min(wake, due);
+
+    auto got = co_await engine.try_async_recv(
+        sock, std::span(buffer).subspan(filled), wake);
+    if (!got || (*got && **got == 0)) {
+      drop_connection();
+      continue;
+    }
+
+    if (!*got)
+      continue; // a request is due or the run is over
+
+    filled += **got;
+    auto at = clock_type::now();
+
+    // complete responses in the buffer, bodies are skipped
+    std::string_view data(reinterpret_cast<const char *>(buffer.data()), filled);
+    std::size_t pos = 0;
+    bool broken = false;
+    bool closed = false;
+
+    while (!closed) {
+      if (!current) {
+        std::size_t head_end = http::find_header_end(data.substr(pos), 0);
+        if (head_end == std::string_view::npos)
+          break;
+
+        current = parse_head(data.substr(pos, head_end));
+        if (!current || in_flight.empty()) {
+          broken = true;
+          break;
+        }
+
+        pos += head_end;
+        res.bytes += head_end;
+        body_left = current->content_length;
+      }
+
+      std::size_t take = std::min(body_left, filled - pos);
+      pos += take;
+      body_left -= take;
+      res.bytes += take;
+      if (body_left > 0)
+        break;
+
+      res.latency.record(std::chrono::nanoseconds(at - in_flight.front()).count());
+      in_flight.pop_front();
+      ++res.responses;
+      if (current->status / 100 != 2)
+        ++res.non_2xx;
+
+      closed = current->close || !load.keep_alive;
+      current.reset();
+    }
+
+    std::memmove(buffer.data(), buffer.data() + pos, filled - pos);
+    filled -= pos;
+
+    // a head that does not fit into the buffer is broken as well
+    if (broken || closed || (!current && filled == buffer.size()))
+      drop_connection();
+  }
+
+  res.unfinished += in_flight.size();
+}
+
+results run(const options &opts) {
+  workload load{.address = loopback(opts.port),
+                .requests = {},
+                .pick = {},
+                .connections = opts.connections,
+                .depth = opts.keep_alive ? opts.pipeline : 1,
+                .keep_alive = opts.keep_alive,
+                .interval = {},
+                .start = {},
+                .end = {}};
+
+  std::vector<unsigned> weights;
+  for (const auto &file : opts.mix) {
+    load.requests.push_back("GET /" + file_name(file.size) + " HTTP/1.1\r\n"
+                            "Host: localhost\r\n" +
+                            (opts.keep_alive ? "" : "Connection: close\r\n") +
+                            "\r\n");
+    weights.push_back(file.weight);
+  }
+  load.pick = std::discrete_distribution<std::size_t>(weights.begin(), weights.end());
+
+  if (opts.rate > 0)
+    load.interval = std::chrono::duration_cast<clock_type::duration>(
+        std::chrono::duration<double>(opts.connections / opts.rate));
+
+  load.start = clock_type::now();
+  load.end = load.start + std::chrono::duration_cast<clock_type::duration>(opts.duration);
+
+  // connections are dealt to the threads round-robin, every thread has its
+  //  own event loop and results (merged after the run)
+  std::vector<results> partial(opts.threads);
+  {
+    std::vector<std::jthread> workers;
+    for (unsigned t = 0; t < opts.threads; ++t)
+      workers.emplace_back([&, t] {
+        coro::io_engine engine(opts.backend);
+
+        for (unsigned id = t; id < opts.connections; id += opts.threads)
+          run_connection(engine, load, id, partial[t]);
+
+        engine.pull_all();
+      });
+  }
+
+  results res;
+  for (const auto &part : partial)
+    res.merge(part);
+
+  return res;
+}
+
+void print_report(const options &opts, const results &res) {
+  double seconds = opts.duration.count();
+
+  std::cout << std::fixed << std::setprecision(1);
+  std::cout << "Requests: " << res.responses << " in " << seconds << " s, "
+            << res.responses / seconds << " req/s";
+  if (opts.rate > 0)
+    std::cout << " (target " << opts.rate << ")";
+  std::cout << '\n';
+
+  std::cout << "Transfer: " << res.bytes / seconds / (1 << 20) << " MiB/s\n";
+  std::cout << "Connections: " << res.connects << " opened, "
+            << res.failed_connects << " failed\n";
+  std::cout << "Errors: " << res.non_2xx << " non-2xx, " << res.lost
+            << " lost, " << res.unfinished << " unfinished\n";
+
+  auto ms = [](double ns) { return ns / 1e6; };
+
+  std::cout << std::setprecision(3) << "Latency (ms):\n";
+  std::cout << "  mean  " << std::setw(10) << ms(res.latency.mean()) << '\n';
+  for (auto [name, p] : {std::pair{"p50", 50.0}, std::pair{"p90", 90.0},
+                         std::pair{"p99", 99.0}, std::pair{"p99.9", 99.9}})
+    std::cout << "  " << std::left << std::setw(6) << name << std::right
+              << std::setw(10) << ms(res.latency.value_at(p)) << '\n';
+  std::cout << "  max   " << std::setw(10) << ms(res.latency.max()) << '\n';
+}
+} // namespace
+
+int main(int argc, char *argv[]) {
+  try {
+    options opts = parse_options(argc, argv);
+
+    docroot_dir docroot(opts.docroot);
+    generate_docroot(docroot.path(), opts.mix);
+
+    if (opts.generate_only) {
+      std::cout << "Generated " << docroot.path() << '\n';
+      return 0;
+    }
+
+    std::optional<server_process> server;
+    if (!opts.server.empty())
+      server.emplace(opts.server, opts.port, docroot.path());
+
+    wait_for_server(loopback(opts.port), server ? &*server : nullptr);
+
+    print_report(opts, run(opts));
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << '\n';
+    return 1;
+  }
+}
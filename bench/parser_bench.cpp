@@ -0,0 +1,159 @@
+// compares http::parse_request with the std::views::split based parsing the
+//  servers used before
+
+#include "request_parser.hpp"
+
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <ranges>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace {
+struct summary {
+  std::string_view method;
+  std::string_view path;
+  std::string_view host;
+  bool keep_alive = true;
+  bool valid = false;
+};
+
+summary split_parser(std::string_view request) {
+  using namespace std::literals;
+  auto lines = std::views::split(request, "\r\n"sv);
+
+  if (std::ranges::distance(lines) <= 2)
+    return {};
+
+  auto parts = std::views::split(lines.front(), " "sv);
+  if (std::ranges::distance(parts) != 3)
+    return {};
+
+  auto to_sv = [](const auto &s) {
+    return std::string_view{s.begin(), s.end()};
+  };
+
+  summary res;
+  auto it = parts.begin();
+  res.method = to_sv(*it);
+  res.path = to_sv(*++it);
+
+  auto headers = lines | std::views::drop(1) |
+                 std::views::take(std::ranges::distance(lines) - 3) |
+                 std::views::transform(to_sv);
+
+  for (auto line : headers) {
+    std::size_t pos = line.find(':');
+    if (pos == std::string_view::npos)
+      return {};
+
+    auto strip = [](std::string_view sv) {
+      while (!sv.empty() && std::isspace(sv.front()))
+        sv.remove_prefix(1);
+      while (!sv.empty() && std::isspace(sv.back()))
+        sv.remove_suffix(1);
+      return sv;
+    };
+
+    auto key = strip(line.substr(0, pos));
+    auto value = strip(line.substr(pos + 1));
+
+    if (key == "Host")
+      res.host = value;
+
+    if (key == "Connection" && value == "close")
+      res.keep_alive = false;
+  }
+
+  res.valid = true;
+  return res;
+}
+
+summary vector_parser(std::string_view request) {
+  http::parsed_request parsed;
+  if (!http::parse_request(request, parsed))
+    return {};
+
+  return {parsed.method, parsed.target, parsed.find("Host"),
+          parsed.find("Connection") != "close", true};
+}
+
+// keep the compiler from dropping the work
+void consume(const summary &s) {
+  asm volatile("" : : "r"(s.method.data()), "r"(s.path.size()),
+               "r"(s.host.data()), "r"(s.keep_alive));
+}
+
+template <typename Parser>
+double ns_per_request(Parser parser, std::string_view request,
+                      std::size_t iterations) {
+  auto start = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < iterations; ++i) {
+    asm volatile("" : : "r"(request.data()) : "memory");
+    consume(parser(request));
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+
+  return std::chrono::duration<double, std::nano>(elapsed).count() /
+         iterations;
+}
+
+std::string browser_request() {
+  return "GET /assets/images/some-rather-long-file-name.png HTTP/1.1\r\n"
+         "Host: localhost:8080\r\n"
+         "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) "
+         "Gecko/20100101 Firefox/128.0\r\n"
+         "Accept: image/avif,image/webp,image/png,image/svg+xml,image/*;"
+         "q=0.8,*/*;q=0.5\r\n"
+         "Accept-Language: en-US,en;q=0.5\r\n"
+         "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+         "Connection: keep-alive\r\n"
+         "Referer: http://localhost:8080/index.html\r\n"
+         "Sec-Fetch-Dest: image\r\n"
+         "Sec-Fetch-Mode: no-cors\r\n"
+         "Sec-Fetch-Site: same-origin\r\n"
+         "Priority: u=5, i\r\n"
+         "Pragma: no-cache\r\n"
+         "Cache-Control: no-cache\r\n"
+         "\r\n";
+}
+} // namespace
+
+int main(int argc, char *argv[]) {
+  std::size_t iterations = argc > 1 ? std::stoull(argv[1]) : 1'000'000;
+
+  struct sample {
+    std::string_view name;
+    std::string request;
+  };
+
+  std::vector<sample> samples{
+      {"curl", "GET /index.html HTTP/1.1\r\n"
+               "Host: localhost:8080\r\n"
+               "User-Agent: curl/8.5.0\r\n"
+               "Accept: */*\r\n"
+               "\r\n"},
+      {"browser", browser_request()},
+  };
+
+  for (const auto &[name, request] : samples) {
+    // both parsers have to agree before their speed is compared
+    auto expected = split_parser(request);
+    auto got = vector_parser(request);
+    if (!expected.valid || !got.valid || expected.path != got.path ||
+        expected.host != got.host || expected.keep_alive != got.keep_alive) {
+      std::cerr << name << ": parsers disagree\n";
+      return 1;
+    }
+
+    double split = ns_per_request(split_parser, request, iterations);
+    double vector = ns_per_request(vector_parser, request, iterations);
+
+    std::cout << name << " (" << request.size() << " bytes): split "
+              << split << " ns, parse_request " << vector << " ns ("
+              << split / vector << "x)\n";
+  }
+}
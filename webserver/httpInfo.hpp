@@ -1,29 +1,97 @@
 #pragma once
 
+#include "content_cache.hpp"
+#include "file_cache.hpp"
+#include "gzip_cache.hpp"
+#include "request_parser.hpp"
+#include "utils.hpp"
+
 #include <algorithm>
 #include <array>
 #include <cassert>
-#include <filesystem>
+#include <ctime>
+#include <memory>
+#include <optional>
 #include <ranges>
 #include <string_view>
 #include <variant>
+#include <vector>
 
 namespace http {
 struct mime_type {
   std::string_view extension;
   std::string_view type;
+  bool compressible; // worth sending with a Content-Encoding
 };
 
 const std::array mime_types = std::to_array<mime_type>({
-    {".txt", "text/plain; charset=utf-8"},
-    {".html", "text/html; charset=utf-8"},
-    {".css", "text/css; charset=utf-8"},
-    {".jpg", "image/jpeg"},
-    {".jpeg", "image/jpeg"},
-    {".png", "image/png"},
-    {".pdf", "application/pdf"},
+    {".txt", "text/plain; charset=utf-8", true},
+    {".html", "text/html; charset=utf-8", true},
+    {".css", "text/css; charset=utf-8", true},
+    {".js", "text/javascript; charset=utf-8", true},
+    {".json", "application/json", true},
+    {".svg", "image/svg+xml", true},
+    {".jpg", "image/jpeg", false},
+    {".jpeg", "image/jpeg", false},
+    {".png", "image/png", false},
+    {".pdf", "application/pdf", false},
 });
 
+// MIME type for the extension of the path (application/octet-stream if
+//  unknown)
+std::string_view mime_type_of(std::string_view path);
+
+// whether files of the MIME type are compressed (false for unknown types)
+bool is_compressible(std::string_view type);
+
+// validators of a version of a file (sent with r200 and r304)
+struct validators {
+  std::string etag;  // "inode-size-mtime" (in hex)
+  time_t mtime = 0;  // Last-Modified
+
+  static validators of(ino_t inode, off_t size, timespec mtime);
+};
+
+// IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT")
+std::string http_date(time_t time);
+
+// content codings of the Accept-Encoding header that the server can send
+//  ("*" accepts both, q=0 refuses a coding)
+struct accept_encoding {
+  bool br = false;
+  bool gzip = false;
+
+  bool any() const { return br || gzip; }
+
+  static accept_encoding of(const parsed_request &req);
+};
+
+// compressed representation of a file
+struct encoded_file {
+  std::string_view coding; // Content-Encoding
+  validators tag;
+
+  // a precompressed sidecar next to the file (file.br or file.gz) or a
+  //  copy compressed on the fly
+  std::shared_ptr<const file_cache::entry> sidecar;
+  std::shared_ptr<const gzip_cache::entry> compressed;
+
+  std::size_t size() const {
+    return sidecar ? sidecar->st.st_size : compressed->data.size();
+  }
+};
+
+// representation of the regular file (at key, relative to root after
+//  prefix) for the accepted codings: its .br sidecar, its .gz sidecar or a
+//  copy from the gzip cache (if given), in this order
+// nullopt if the file should be sent as it is
+std::optional<encoded_file> select_encoding(accept_encoding codings,
+                                            file_cache &files,
+                                            gzip_cache *gzip, int root,
+                                            std::string_view key,
+                                            std::size_t prefix,
+                                            const file_cache::entry &file);
+
 namespace detail {
 struct http_response {
   int code;
@@ -33,6 +101,8 @@ struct http_response {
 
 const std::array http_responses = std::to_array<http_response>({
     {200, "200 OK", ""},
+    {206, "206 Partial Content", ""},
+    {304, "304 Not Modified", ""},
     {301, "301 Moved Permanently",
      R"(<!DOCTYPE html>
 <html>
@@ -65,6 +135,28 @@ const std::array http_responses = std::to_array<http_response>({
     <h1>Not Found</h1>
     <p>The requested URL was not found on this server.</p>
   </body>
+</html>)"},
+    {416, "416 Range Not Satisfiable",
+     R"(<!DOCTYPE html>
+<html>
+  <head>
+    <title>416 Range Not Satisfiable</title>
+  </head>
+  <body>
+    <h1>Range Not Satisfiable</h1>
+    <p>None of the requested ranges overlap the resource.</p>
+  </body>
+</html>)"},
+    {431, "431 Request Header Fields Too Large",
+     R"(<!DOCTYPE html>
+<html>
+  <head>
+    <title>431 Request Header Fields Too Large</title>
+  </head>
+  <body>
+    <h1>Request Header Fields Too Large</h1>
+    <p>The request head is larger than the server is willing to process.</p>
+  </body>
 </html>)"},
     {500, "500 Internal Server Error",
      R"(<!DOCTYPE html>
@@ -87,6 +179,17 @@ const std::array http_responses = std::to_array<http_response>({
     <h1>Not Implemented</h1>
     <p>The server does not support the functionality required to fulfill the request.</p>
   </body>
+</html>)"},
+    {503, "503 Service Unavailable",
+     R"(<!DOCTYPE html>
+<html>
+  <head>
+    <title>503 Service Unavailable</title>
+  </head>
+  <body>
+    <h1>Service Unavailable</h1>
+    <p>The server is overloaded, please try again later.</p>
+  </body>
 </html>)"},
 });
 
@@ -111,9 +214,39 @@ template <int Code> struct simple_response {
 } // namespace detail
 
 struct r200 : detail::simple_response<200> { // OK
-  std::filesystem::path file_path;
+  // key of the file in the caches (directory/host/path), points into a
+  //  per-thread buffer that is reused by the next request of the thread
+  std::string_view file_path;
+
+  // response found in the content cache (if any)
+  std::shared_ptr<const content_cache::entry> cached;
+
+  // the opened file (with its stat and MIME type)
+  std::shared_ptr<const file_cache::entry> file;
+
+  // sent instead of the file if set
+  std::optional<encoded_file> encoded;
+
+  // taken before the file was opened, the content cache may refuse it
+  content_cache::ticket ticket = 0;
+
+  std::string_view mime_type() const;
+};
+// inclusive range of bytes of a file
+struct byte_range {
+  off_t first;
+  off_t last;
+
+  std::size_t length() const { return last - first + 1; }
+};
+
+struct r206 : detail::simple_response<206> { // Partial Content
+  std::string_view file_path;
+  std::shared_ptr<const file_cache::entry> file;
+
+  // several ranges are sent as multipart/byteranges
+  std::vector<byte_range> ranges;
 
-  std::string content() const;
   std::string_view mime_type() const;
 };
 struct r301 : detail::simple_response<301> { // Moved Permanently
@@ -125,16 +258,66 @@ struct r301 : detail::simple_response<301> { // Moved Permanently
     return res;
   }
 };
+struct r304 : detail::simple_response<304> { // Not Modified
+  validators file;
+  bool compressible = false; // the 200 would vary by Accept-Encoding
+};
 struct r403 : detail::simple_response<403> {}; // Forbidden
 struct r404 : detail::simple_response<404> {}; // Not Found
+struct r416 : detail::simple_response<416> { // Range Not Satisfiable
+  off_t file_size;
+};
+struct r431 : detail::simple_response<431> {}; // Request Header Fields Too Large
 struct r500 : detail::simple_response<500> {}; // Internal Server Error
 struct r501 : detail::simple_response<501> {}; // Not Implemented
+struct r503 : detail::simple_response<503> {}; // Service Unavailable
 
 struct request {
-  std::variant<r200, r301, r403, r404, r500, r501> data = r501{};
+  std::variant<r200, r206, r301, r304, r403, r404, r416, r431, r500, r501,
+               r503>
+      data = r501{};
   bool keep_alive{true};
 };
 
-std::string get_response(std::string_view version, const request &req);
+struct response {
+  // code of the status line
+  int status = 0;
+
+  // status line, headers and the body (except for r200)
+  std::string head;
+
+  // r200 from the content or gzip cache: sent after the head (cached or
+  //  compressed keeps it alive)
+  std::string_view body;
+  std::shared_ptr<const content_cache::entry> cached;
+  std::shared_ptr<const gzip_cache::entry> compressed;
+
+  // other r200 and r206: parts of file->fd (or of an encoded sidecar) sent after the head (each after
+  //  its prefix), then the tail
+  struct file_part {
+    std::string prefix;
+    off_t offset;
+    std::size_t length;
+  };
+
+  std::shared_ptr<const file_cache::entry> file;
+  std::vector<file_part> parts;
+  std::string tail;
+};
+
+// r304 if the conditional headers of the request (If-None-Match or, without
+//  it, If-Modified-Since) say that the client has this version of the file
+std::optional<r304> check_not_modified(const parsed_request &req,
+                                       validators file);
+
+// ranges of the Range header of the request that the file should be answered
+//  with: nullopt if the whole file should be sent (no or malformed Range, or
+//  If-Range that does not match), empty if none of them can be satisfied
+std::optional<std::vector<byte_range>>
+requested_ranges(const parsed_request &req, const struct stat &st);
+
+// small r200 files are read into the cache (if given) and served from there
+response get_response(std::string_view version, const request &req,
+                      content_cache *cache = nullptr);
 
 } // namespace http
\ No newline at end of file
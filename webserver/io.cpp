@@ -14,8 +14,16 @@ using namespace io;
 input_data io::parse_input(int argc, char *argv[]) {
   input_data res;
 
-  if (argc != 3) {
-    std::cerr << "Usage: " << argv[0] << " <port> <directory>\n";
+  if (argc < 3) {
+    std::cerr << "Usage: " << argv[0] << " <port> <directory> [OPTIONS]\n";
+    std::cerr << "Options:\n";
+    std::cerr << "  --cache <MiB>: size of the static content cache (default: 32, 0 disables it)\n";
+    std::cerr << "  --open-files <n>: number of cached file descriptors (default: 256)\n";
+    std::cerr << "  --max-header-size <bytes>: size of connection buffers, bigger request heads get 431 (default: 8192)\n";
+    std::cerr << "  --header-timeout <s>: time to send a whole request head (default: 5)\n";
+    std::cerr << "  --access-log <file|->: append an access log of every request to the file (or stdout)\n";
+    std::cerr << "  --log-format <common|combined>: format of the access log lines, followed by the latency in seconds (default: combined)\n";
+    std::cerr << "  --gzip <MiB>: gzip compressible files on the fly and keep up to MiB of them (default: 0, off)\n";
     throw std::invalid_argument("Invalid number of arguments");
   }
 
@@ -32,5 +40,66 @@ input_data io::parse_input(int argc, char *argv[]) {
     throw std::invalid_argument("Not a directory");
   }
 
+  // rest of args are optional
+  for (int i = 3; i < argc; ++i) {
+    std::string_view arg = argv[i];
+    if (arg == "--cache" && i + 1 < argc) {
+      int size = std::stoi(argv[++i]);
+      if (size < 0) {
+        std::cerr << "--cache must not be negative\n";
+        throw std::invalid_argument("Invalid cache size");
+      }
+
+      res.cache_size = static_cast<std::size_t>(size) << 20;
+    } else if (arg == "--open-files" && i + 1 < argc) {
+      int files = std::stoi(argv[++i]);
+      if (files < 0) {
+        std::cerr << "--open-files must not be negative\n";
+        throw std::invalid_argument("Invalid open file count");
+      }
+
+      res.open_files = files;
+    } else if (arg == "--gzip" && i + 1 < argc) {
+      int size = std::stoi(argv[++i]);
+      if (size < 0) {
+        std::cerr << "--gzip must not be negative\n";
+        throw std::invalid_argument("Invalid gzip cache size");
+      }
+
+      res.gzip_cache_size = static_cast<std::size_t>(size) << 20;
+    } else if (arg == "--max-header-size" && i + 1 < argc) {
+      int size = std::stoi(argv[++i]);
+      if (size < 64) {
+        std::cerr << "--max-header-size must be at least 64\n";
+        throw std::invalid_argument("Invalid header size");
+      }
+
+      res.max_header_size = size;
+    } else if (arg == "--header-timeout" && i + 1 < argc) {
+      int seconds = std::stoi(argv[++i]);
+      if (seconds <= 0) {
+        std::cerr << "--header-timeout must be positive\n";
+        throw std::invalid_argument("Invalid timeout");
+      }
+
+      res.header_timeout = std::chrono::seconds(seconds);
+    } else if (arg == "--access-log" && i + 1 < argc) {
+      res.access_log = argv[++i];
+    } else if (arg == "--log-format" && i + 1 < argc) {
+      std::string_view format = argv[++i];
+      if (format == "common")
+        res.log_format = http::access_log::format::common;
+      else if (format == "combined")
+        res.log_format = http::access_log::format::combined;
+      else {
+        std::cerr << "Unknown log format: " << format << '\n';
+        throw std::invalid_argument("Unknown log format");
+      }
+    } else {
+      std::cerr << "Unknown option: " << argv[i] << '\n';
+      throw std::invalid_argument("Unknown option");
+    }
+  }
+
   return res;
 }
\ No newline at end of file
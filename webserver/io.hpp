@@ -1,8 +1,11 @@
 #pragma once
 
+#include "access_log.hpp"
+
 #include <vector>
 #include <utility>
 #include <fstream>
+#include <chrono>
 #include <cstdint>
 #include <filesystem>
 
@@ -10,6 +13,13 @@ namespace io {
 struct input_data {
   std::uint16_t port;
   std::filesystem::path directory;
+  std::size_t cache_size = 32 << 20; // bytes (0 disables the cache)
+  std::size_t open_files = 256;      // cached file descriptors
+  std::size_t gzip_cache_size = 0;   // bytes (0: no on-the-fly gzip)
+  std::size_t max_header_size = 8192; // bigger request heads get 431
+  std::chrono::seconds header_timeout{5}; // to receive a whole request head
+  std::filesystem::path access_log;       // "-" for stdout (empty: no log)
+  http::access_log::format log_format = http::access_log::format::combined;
 };
 
 input_data parse_input(int argc, char *argv[]);
@@ -1,7 +1,11 @@
 #include "utils.hpp"
 
 #include <arpa/inet.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 
+#include <algorithm>
+#include <climits>
 #include <stdexcept>
 #include <system_error>
 #include <bit>
@@ -41,4 +45,50 @@ void utils::send_all(const handle &sock, std::span<const std::byte> data) {
 
 void utils::send_all(const handle &sock, std::string_view data) {
   send_all(sock, {reinterpret_cast<const std::byte *>(data.data()), data.size()});
-}
\ No newline at end of file
+}
+
+void utils::send_all(const handle &sock, std::span<iovec> buffers,
+                     int flags) {
+  while (!buffers.empty()) {
+    msghdr msg{};
+    msg.msg_iov = buffers.data();
+    msg.msg_iovlen = std::min<std::size_t>(buffers.size(), IOV_MAX);
+
+    ssize_t bytes_sent = sendmsg(sock, &msg, MSG_NOSIGNAL | flags);
+    if (bytes_sent < 0) {
+      if (errno == EINTR)
+        continue;
+      throw_sys_error("sendmsg");
+    }
+
+    // drop the buffers that were sent, the last one may be partial
+    std::size_t left = bytes_sent;
+    while (!buffers.empty() && left >= buffers.front().iov_len) {
+      left -= buffers.front().iov_len;
+      buffers = buffers.subspan(1);
+    }
+
+    if (left > 0) {
+      buffers.front().iov_base = static_cast<char *>(buffers.front().iov_base) + left;
+      buffers.front().iov_len -= left;
+    }
+  }
+}
+
+void utils::send_file(const handle &sock, int file, off_t offset,
+                      std::size_t count) {
+  while (count > 0) {
+    ssize_t bytes_sent = sendfile(sock, file, &offset, count);
+    if (bytes_sent < 0) {
+      if (errno == EINTR)
+        continue;
+      throw_sys_error("sendfile");
+    }
+
+    // file got truncated
+    if (bytes_sent == 0)
+      throw std::runtime_error("sendfile: unexpected end of file");
+
+    count -= bytes_sent;
+  }
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <span>
@@ -40,4 +41,12 @@ struct overload : Ts... {
 
 void send_all(const handle &sock, std::span<const std::byte> data);
 void send_all(const handle &sock, std::string_view data);
+
+// gathers the buffers into as few sendmsg calls as possible (the iovecs are
+//  advanced over what was sent), MSG_MORE in flags holds back a partial
+//  segment for the data that follows (a sendfile)
+void send_all(const handle &sock, std::span<iovec> buffers, int flags = 0);
+
+// send count bytes of file (starting at offset) with sendfile
+void send_file(const handle &sock, int file, off_t offset, std::size_t count);
 } // namespace utils
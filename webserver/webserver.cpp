@@ -1,79 +1,92 @@
+#include "access_log.hpp"
+#include "host_roots.hpp"
 #include "httpInfo.hpp"
 #include "io.hpp"
+#include "request_parser.hpp"
 #include "utils.hpp"
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <poll.h>
+#include <signal.h>
 #include <sys/socket.h>
 
+#include <algorithm>
 #include <array>
+#include <chrono>
+#include <cstdint>
 #include <filesystem>
 #include <iostream>
-#include <ranges>
+#include <optional>
+#include <span>
 #include <string_view>
+#include <utility>
+#include <vector>
 
 namespace {
-http::request get_request_data(std::string_view request,
-                               const std::filesystem::path &directory) {
-  // request format: <method> <path> <version>\r\n<headers>\r\n
-  using namespace std::literals;
-  auto lines = std::views::split(request, "\r\n"sv);
-
-  if (std::ranges::distance(lines) <= 2)
-    return {};
-
-  auto parts = std::views::split(lines.front(), " "sv);
-  if (std::ranges::distance(parts) != 3)
-    return {};
-
-  auto to_sv = [](const auto &s) {
-    return std::string_view{s.begin(), s.end()};
-  };
-
-  auto it = parts.begin();
-  std::string_view method = to_sv(*it);
-  std::filesystem::path path = to_sv(*++it);
-  std::string_view version = to_sv(*++it);
+// set by SIGUSR1, the stats are printed by the accept loop
+volatile sig_atomic_t stats_requested = 0;
+
+void print_cache_stats(const http::content_cache &cache) {
+  auto stats = cache.stats();
+  std::cout << "Content cache: " << stats.hits << " hits, " << stats.misses
+            << " misses, " << stats.evictions << " evictions, "
+            << stats.invalidations << " invalidations, " << stats.entries
+            << " entries (" << stats.bytes << " bytes)" << std::endl;
+}
 
-  if (method != "GET")
-    return {};
+void print_file_cache_stats(const http::file_cache &files) {
+  auto stats = files.stats();
+  std::cout << "File cache: " << stats.hits << " hits, " << stats.revalidations
+            << " revalidations, " << stats.misses << " misses, "
+            << stats.evictions << " evictions, " << stats.entries
+            << " entries" << std::endl;
+}
 
-  if (version != "HTTP/1.1")
-    return {};
+void print_gzip_cache_stats(const http::gzip_cache &gzip) {
+  auto stats = gzip.stats();
+  std::cout << "Gzip cache: " << stats.hits << " hits, " << stats.misses
+            << " misses, " << stats.evictions << " evictions, "
+            << stats.entries << " entries (" << stats.bytes << " bytes)"
+            << std::endl;
+}
 
-  // file path is at directory/host/path
+void print_access_log_stats(const http::access_log &log) {
+  auto stats = log.stats();
+  std::cout << "Access log: " << stats.written << " written, "
+            << stats.dropped << " dropped" << std::endl;
+}
 
-  auto headers = lines | std::views::drop(1) |
-                 std::views::take(std::ranges::distance(lines) - 3) |
-                 std::views::transform(to_sv);
+// caches and roots of the server (live as long as main)
+struct server_state {
+  const http::host_roots *roots = nullptr;
+  http::content_cache *cache = nullptr;
+  http::file_cache *files = nullptr;
+  http::gzip_cache *gzip = nullptr;
 
-  bool keep_alive = true;
+  std::size_t max_header_size = 0;
+  std::chrono::seconds header_timeout{};
 
-  std::string_view host;
-  for (auto line : headers) {
-    std::size_t pos = line.find(':');
-    if (pos == std::string_view::npos)
-      return {};
+  // every answered request is logged if set
+  http::access_log *log = nullptr;
+};
 
-    // strip whitespaces
-    auto strip = [](std::string_view sv) {
-      while (!sv.empty() && std::isspace(sv.front()))
-        sv.remove_prefix(1);
-      while (!sv.empty() && std::isspace(sv.back()))
-        sv.remove_suffix(1);
-      return sv;
-    };
+http::request get_request_data(std::string_view request,
+                               const server_state &state) {
+  // request format: <method> <path> <version>\r\n<headers>\r\n
+  http::parsed_request parsed;
+  if (!http::parse_request(request, parsed))
+    return {};
 
-    auto key = strip(line.substr(0, pos));
-    auto value = strip(line.substr(pos + 1));
+  if (parsed.method != "GET")
+    return {};
 
-    if (key == "Host")
-      host = value;
+  if (parsed.version != "HTTP/1.1")
+    return {};
 
-    if (key == "Connection" && value == "close")
-      keep_alive = false;
-  }
+  std::string_view path = parsed.target;
+  std::string_view host = parsed.find("Host");
+  bool keep_alive = parsed.find("Connection") != "close";
 
   if (host.empty())
     return {};
@@ -82,60 +95,209 @@ http::request get_request_data(std::string_view request,
   if (host.find('/') != std::string::npos)
     return {};
 
-  // check if path is valid (all ".." should not move above the root directory)
-  //  make path a normal form (before that remove leading / to preserve all
-  //  leading ..)
-  path = path.lexically_proximate("/").lexically_normal();
+  std::string_view host_no_port = host.substr(0, host.find_last_of(':'));
 
-  // if any .. survived that means we are going above the root
-  if (path.native().find("..") != std::string::npos)
-    return {http::r403{}, keep_alive}; // forbidden
+  auto *root = state.roots->find(host_no_port);
+  if (!root)
+    return {http::r404{}, keep_alive};
 
-  std::string_view host_no_port = host.substr(0, host.find_last_of(':'));
+  // the kernel keeps the path beneath the root of the host (openat2), so
+  //  it is used as it came (without the leading slashes)
+  std::string_view relative =
+      path.substr(std::min(path.find_first_not_of('/'), path.size()));
+  if (relative.empty())
+    relative = ".";
+
+  // cache key directory/host/path (reuses the buffer of the thread)
+  thread_local std::string file_path;
+  file_path.assign(root->prefix);
+  file_path.append(relative);
+
+  // ranges are always served from the file (as it is)
+  bool ranged = !parsed.find("Range").empty();
+  auto codings =
+      ranged ? http::accept_encoding{} : http::accept_encoding::of(parsed);
+
+  // the content cache only has files as they are
+  bool compressible = http::is_compressible(http::mime_type_of(file_path));
+  bool identity = !codings.any() || !compressible;
+
+  if (state.cache && !ranged && identity) {
+    if (auto cached = state.cache->find(file_path)) {
+      if (auto r304 = http::check_not_modified(
+              parsed,
+              http::validators::of(cached->inode, cached->size,
+                                   cached->mtime))) {
+        r304->compressible = compressible;
+        return {std::move(*r304), keep_alive};
+      }
 
-  std::filesystem::path file_path = directory / host_no_port / path;
+      return {http::r200{{}, file_path, std::move(cached), nullptr,
+                         std::nullopt, 0},
+              keep_alive};
+    }
+  }
+
+  // a response read below may fill the content cache, it is read from the
+  //  file the path names now (an fd trusted for a while could be a file
+  //  replaced before the ticket was taken)
+  bool fills_cache = state.cache && !ranged && identity;
+  http::content_cache::ticket ticket = 0;
+  if (fills_cache)
+    ticket = state.cache->prepare(file_path);
+
+  auto file = state.files->lookup(root->fd, file_path, root->prefix.size(),
+                                  fills_cache);
+  using kind = http::file_cache::entry::kind;
 
-  if (!std::filesystem::exists(file_path))
+  if (file->type == kind::missing)
     return {http::r404{}, keep_alive};
 
-  if (std::filesystem::is_directory(file_path)) {
-    auto index_path = (host / path / "index.html").lexically_normal();
+  if (file->type == kind::forbidden)
+    return {http::r403{}, keep_alive};
+
+  if (file->type == kind::directory) {
+    auto index_path = (std::filesystem::path(host) / relative / "index.html")
+                          .lexically_normal();
     return {http::r301{{}, "http://" + index_path.generic_string()},
             keep_alive}; // permanent redirect
   }
 
-  return {http::r200{{}, file_path}, keep_alive};
+  // a precompressed sidecar or a copy from the gzip cache
+  std::optional<http::encoded_file> encoded;
+  if (!identity)
+    encoded = http::select_encoding(codings, *state.files, state.gzip,
+                                    root->fd, file_path, root->prefix.size(),
+                                    *file);
+
+  // unchanged files cost only the head
+  if (auto r304 = http::check_not_modified(
+          parsed, encoded ? encoded->tag
+                          : http::validators::of(file->st.st_ino,
+                                                 file->st.st_size,
+                                                 file->st.st_mtim))) {
+    r304->compressible = compressible;
+    return {std::move(*r304), keep_alive};
+  }
+
+  if (ranged)
+    if (auto ranges = http::requested_ranges(parsed, file->st)) {
+      if (ranges->empty())
+        return {http::r416{{}, file->st.st_size}, keep_alive};
+
+      return {http::r206{{}, file_path, std::move(file), std::move(*ranges)},
+              keep_alive};
+    }
+
+  return {http::r200{{}, file_path, nullptr, std::move(file),
+                     std::move(encoded), ticket},
+          keep_alive};
 }
 
-bool handle_request(const utils::handle &sock, std::string_view request,
-                    const std::filesystem::path &directory) {
-  std::string response;
+std::pair<http::response, bool>
+build_response(std::string_view request, const server_state &state) {
+  http::response response;
 
   http::request req;
 
   try {
-    req = get_request_data(request, directory);
-    response = http::get_response("HTTP/1.1", req);
+    req = get_request_data(request, state);
+    response = http::get_response("HTTP/1.1", req, state.cache);
   } catch (...) {
     // send internal server error instead
     req = {http::r500{}};
     response = http::get_response("HTTP/1.1", req);
   }
 
-  utils::send_all(sock, response);
-  return req.keep_alive;
+  return {std::move(response), req.keep_alive};
 }
 
-void handle_client(const utils::handle &sock,
-                   const std::filesystem::path &directory) {
-  // wait for HTTP request (close connection after 1s of inactivity)
+// answer pipelined requests in order (none after one that closes the
+//  connection), returns whether the connection stays open
+bool handle_requests(const utils::handle &sock,
+                     std::span<const std::string_view> requests,
+                     const server_state &state, std::uint32_t client,
+                     std::chrono::steady_clock::time_point head_start) {
+  std::vector<std::pair<http::response, bool>> responses;
+  responses.reserve(requests.size());
+
+  for (auto request : requests) {
+    responses.push_back(build_response(request, state));
+    if (!responses.back().second)
+      break;
+  }
+
+  // heads and bodies of all responses go out with one sendmsg, files (or
+  //  their ranges) are sent with sendfile in between
+  std::vector<iovec> buffers;
+  buffers.reserve(2 * responses.size());
+  std::size_t buffered = 0;
+  std::uint64_t sent = 0;
+
+  auto add = [&](std::string_view data) {
+    if (!data.empty())
+      buffers.push_back({const_cast<char *>(data.data()), data.size()});
+    buffered += data.size();
+  };
+
+  try {
+    for (const auto &[response, keep_alive] : responses) {
+      add(response.head);
+      add(response.body);
+
+      for (const auto &part : response.parts) {
+        add(part.prefix);
+
+        // the head goes out in one segment with the start of the file
+        //  (alone Nagle would hold the file back until the client ACKs
+        //  the head)
+        utils::send_all(sock, buffers, part.length > 0 ? MSG_MORE : 0);
+        buffers.clear();
+        sent += std::exchange(buffered, 0);
+
+        utils::send_file(sock, response.file->fd, part.offset, part.length);
+        sent += part.length;
+      }
+
+      add(response.tail);
+    }
+
+    utils::send_all(sock, buffers);
+    sent += buffered;
+  } catch (...) {
+    // the client went away, what was sent is still logged
+    if (state.log)
+      state.log->log_batch(client, requests, responses, sent, head_start);
+    throw;
+  }
+
+  if (state.log)
+    state.log->log_batch(client, requests, responses, sent, head_start);
+
+  return responses.back().second;
+}
 
-  auto timeout = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+void handle_client(const utils::handle &sock, const server_state &state,
+                   std::uint32_t client) {
+  using clock = std::chrono::steady_clock;
 
-  // holds unconsumed data
+  // wait for HTTP request (close connection after 1s of inactivity, or when
+  //  the head of a request takes longer than the header timeout however
+  //  slowly it trickles in)
+  auto timeout = clock::now() + std::chrono::seconds(1);
+  auto header_deadline = clock::time_point::max();
+
+  // since when the request heads in the buffer were coming in
+  auto head_start = clock::now();
+
+  // holds unconsumed data (at most max_header_size bytes)
   std::string buffer_since_last;
 
-  while (std::chrono::steady_clock::now() < timeout) {
+  auto deadline = [&] {
+    return buffer_since_last.empty() ? timeout : header_deadline;
+  };
+
+  while (clock::now() < deadline()) {
     // use poll()
 
     pollfd pfd;
@@ -143,7 +305,11 @@ void handle_client(const utils::handle &sock,
     pfd.events = POLLIN;
     pfd.revents = 0;
 
-    int ret = poll(&pfd, 1, 1000);
+    auto remaining = std::chrono::ceil<std::chrono::milliseconds>(
+        deadline() - clock::now());
+    int ret = poll(&pfd, 1, std::clamp<int>(remaining.count(), 0, 1000));
+    if (ret == -1 && errno == EINTR)
+      continue;
     if (ret == -1)
       utils::throw_sys_error("poll");
 
@@ -160,11 +326,13 @@ void handle_client(const utils::handle &sock,
 
     do {
       char buffer[1024];
-      bytes_read = recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT);
+      std::size_t space = state.max_header_size - buffer_since_last.size();
+      bytes_read =
+          recv(sock, buffer, std::min(sizeof(buffer), space), MSG_DONTWAIT);
 
-      // if EINTR, try again
+      // if EINTR, try again, if there is nothing more wait with poll
       if (bytes_read < 0) {
-        if (errno == EINTR)
+        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
           continue;
         utils::throw_sys_error("recv");
       }
@@ -174,19 +342,44 @@ void handle_client(const utils::handle &sock,
         return;
 
       // process data
+      if (buffer_since_last.empty()) {
+        head_start = clock::now();
+        header_deadline = head_start + state.header_timeout;
+      }
       buffer_since_last.append(buffer, bytes_read);
-      timeout = std::chrono::steady_clock::now() + std::chrono::seconds(1);
-
-      // check if we have a full request
-      auto pos = buffer_since_last.find("\r\n\r\n");
-
-      if (pos != std::string::npos) {
-        std::string_view request(buffer_since_last.data(), pos + 4);
-        
-        if (!handle_request(sock, request, directory))
+      timeout = clock::now() + std::chrono::seconds(1);
+
+      // answer all full (pipelined) requests we have at once
+      std::vector<std::string_view> requests;
+      std::size_t consumed = 0;
+      for (std::size_t end;
+           (end = http::find_header_end(buffer_since_last, consumed)) !=
+           std::string::npos;
+           consumed = end)
+        requests.emplace_back(buffer_since_last.data() + consumed,
+                              end - consumed);
+
+      if (!requests.empty()) {
+        if (!handle_requests(sock, requests, state, client, head_start))
           return;
 
-        buffer_since_last.erase(0, pos + 4);
+        buffer_since_last.erase(0, consumed);
+        head_start = clock::now();
+        header_deadline = head_start + state.header_timeout;
+      }
+
+      // the head of the request does not fit into the buffer
+      if (buffer_since_last.size() == state.max_header_size) {
+        auto response = http::get_response(
+            "HTTP/1.1", http::request{http::r431{}, false});
+        utils::send_all(sock, response.head);
+
+        // logged without a request line (it may be incomplete)
+        if (state.log)
+          state.log->log(client, {}, response.status, response.head.size(),
+                         clock::now() - head_start,
+                         std::chrono::system_clock::now());
+        return;
       }
     } while (bytes_read > 0);
   }
@@ -195,6 +388,40 @@ void handle_client(const utils::handle &sock,
 
 int main(int argc, char *argv[]) {
   io::input_data data = io::parse_input(argc, argv);
+
+  // without an event loop the cache checks the mtime of files on every hit
+  std::optional<http::content_cache> cache;
+  if (data.cache_size > 0)
+    cache.emplace(data.cache_size);
+
+  http::host_roots roots(data.directory);
+  http::file_cache files(http::mime_type_of, data.open_files);
+
+  std::optional<http::gzip_cache> gzip;
+  if (data.gzip_cache_size > 0)
+    gzip.emplace(data.gzip_cache_size);
+
+  // the writer runs on its own thread, requests are still answered one by
+  //  one
+  std::optional<http::access_log> log;
+  if (!data.access_log.empty())
+    log.emplace(data.access_log, data.log_format);
+
+  server_state state{&roots,
+                     cache ? &*cache : nullptr,
+                     &files,
+                     gzip ? &*gzip : nullptr,
+                     data.max_header_size,
+                     data.header_timeout,
+                     log ? &*log : nullptr};
+
+  // SIGUSR1 prints the cache counters (no SA_RESTART, so that a blocking
+  //  accept returns)
+  struct sigaction sa {};
+  sa.sa_handler = [](int) { stats_requested = 1; };
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1, &sa, nullptr);
+
   utils::handle server_socket(socket(AF_INET, SOCK_STREAM, 0));
 
   if (!server_socket)
@@ -213,13 +440,29 @@ int main(int argc, char *argv[]) {
     utils::throw_sys_error("listen");
 
   while (true) {
-    utils::handle client_socket(accept(server_socket, nullptr, nullptr));
+    if (stats_requested) {
+      stats_requested = 0;
+      if (cache)
+        print_cache_stats(*cache);
+      print_file_cache_stats(files);
+      if (gzip)
+        print_gzip_cache_stats(*gzip);
+      if (log)
+        print_access_log_stats(*log);
+    }
+
+    sockaddr_in client{};
+    socklen_t client_length = sizeof(client);
+    utils::handle client_socket(accept(
+        server_socket, reinterpret_cast<sockaddr *>(&client), &client_length));
+    if (!client_socket && errno == EINTR)
+      continue;
     if (!client_socket)
       utils::throw_sys_error("accept");
 
     // handle client synchronously (no need to handle multiple clients)
     try {
-      handle_client(client_socket, data.directory);
+      handle_client(client_socket, state, client.sin_addr.s_addr);
     } catch (...) {
       // ignore
     }
@@ -0,0 +1,293 @@
+#include "access_log.hpp"
+#include "request_parser.hpp"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <ctime>
+#include <span>
+#include <string>
+#include <system_error>
+#include <vector>
+
+using namespace http;
+
+namespace {
+// records the writer formats before a single writev
+constexpr std::size_t max_batch = 256;
+
+// how long the writer sleeps when there is nothing to write (logging itself
+//  never wakes it up, that would cost a syscall per request)
+constexpr auto flush_interval = std::chrono::milliseconds(10);
+
+// longest copy of each string of an entry
+constexpr std::array<std::size_t, 5> max_lengths{16, 256, 16, 128, 480};
+
+// quotes, backslashes and bytes that are not printable ASCII as \xHH
+void append_escaped(std::string &out, std::string_view text) {
+  if (text.empty()) {
+    out.push_back('-');
+    return;
+  }
+
+  for (char c : text) {
+    auto byte = static_cast<unsigned char>(c);
+    if (c == '"' || c == '\\' || byte < 0x20 || byte >= 0x7f) {
+      constexpr std::string_view digits = "0123456789ABCDEF";
+      out.append("\\x");
+      out.push_back(digits[byte >> 4]);
+      out.push_back(digits[byte & 0xf]);
+    } else {
+      out.push_back(c);
+    }
+  }
+}
+
+// [10/Oct/2000:13:55:36 +0000], reformatted only when the second changes
+class clf_time {
+public:
+  std::string_view of(std::int64_t seconds) {
+    if (seconds != last) {
+      std::time_t time = seconds;
+      std::tm tm;
+      gmtime_r(&time, &tm);
+      length = std::strftime(text.data(), text.size(),
+                             "[%d/%b/%Y:%H:%M:%S +0000]", &tm);
+      last = seconds;
+    }
+
+    return {text.data(), length};
+  }
+
+private:
+  std::int64_t last = -1;
+  std::array<char, 40> text;
+  std::size_t length = 0;
+};
+
+template <typename T> void append_number(std::string &out, T value) {
+  std::array<char, 32> text;
+  auto [end, ec] = std::to_chars(text.data(), text.data() + text.size(), value);
+  out.append(text.data(), end);
+}
+} // namespace
+
+access_log::access_log(const std::filesystem::path &path, format type,
+                       std::size_t capacity)
+    : type(type), mask(std::bit_ceil(std::max<std::size_t>(capacity, 2)) - 1),
+      slots(std::make_unique<slot[]>(mask + 1)) {
+  for (std::size_t i = 0; i <= mask; ++i)
+    slots[i].sequence.store(i, std::memory_order_relaxed);
+
+  if (path == "-") {
+    fd = STDOUT_FILENO;
+  } else {
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1)
+      throw std::system_error(errno, std::system_category(),
+                              "open " + path.string());
+    owns_fd = true;
+  }
+
+  writer = std::jthread([this](std::stop_token stop) { run(stop); });
+}
+
+access_log::~access_log() {
+  writer.request_stop();
+  writer.join();
+
+  if (owns_fd)
+    close(fd);
+}
+
+bool access_log::log(const entry &e) {
+  // claim a slot: its sequence equals the position when it is free, it
+  //  lags behind while the writer has not taken the previous record yet
+  std::size_t pos = tail.load(std::memory_order_relaxed);
+  slot *s;
+
+  while (true) {
+    s = &slots[pos & mask];
+    std::size_t sequence = s->sequence.load(std::memory_order_acquire);
+    auto diff = static_cast<std::ptrdiff_t>(sequence - pos);
+
+    if (diff == 0) {
+      if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    } else {
+      pos = tail.load(std::memory_order_relaxed);
+    }
+  }
+
+  auto &r = s->data;
+  r.time = std::chrono::duration_cast<std::chrono::seconds>(
+               e.time.time_since_epoch())
+               .count();
+  r.latency = e.latency.count();
+  r.bytes = e.bytes;
+  r.client = e.client;
+  r.status = static_cast<std::uint16_t>(std::clamp(e.status, 0, 999));
+
+  std::array<std::string_view, 5> fields{e.method, e.target, e.version};
+  if (type == format::combined) {
+    fields[3] = e.referer;
+    fields[4] = e.user_agent;
+  }
+
+  std::size_t used = 0;
+  for (std::size_t i = 0; i < fields.size(); ++i) {
+    std::size_t length =
+        std::min({fields[i].size(), max_lengths[i], r.text.size() - used});
+    std::memcpy(r.text.data() + used, fields[i].data(), length);
+    r.lengths[i] = length;
+    used += length;
+  }
+
+  s->sequence.store(pos + 1, std::memory_order_release);
+  return true;
+}
+
+bool access_log::log(std::uint32_t client, std::string_view request,
+                     int status, std::uint64_t bytes,
+                     std::chrono::nanoseconds latency,
+                     std::chrono::system_clock::time_point time) {
+  entry e;
+  e.client = client;
+  e.status = status;
+  e.bytes = bytes;
+  e.latency = latency;
+  e.time = time;
+
+  parsed_request parsed;
+  if (parse_request(request, parsed)) {
+    e.method = parsed.method;
+    e.target = parsed.target;
+    e.version = parsed.version;
+    e.referer = parsed.find("Referer");
+    e.user_agent = parsed.find("User-Agent");
+  }
+
+  return log(e);
+}
+
+access_log::statistics access_log::stats() const {
+  return {written.load(std::memory_order_relaxed),
+          dropped.load(std::memory_order_relaxed)};
+}
+
+void access_log::run(std::stop_token stop) {
+  std::vector<std::string> lines(max_batch);
+  std::vector<iovec> buffers;
+  buffers.reserve(max_batch);
+  clf_time time;
+
+  auto format_line = [&](const record &r, std::string &out) {
+    out.clear();
+
+    std::array<std::string_view, 5> fields;
+    for (std::size_t i = 0, at = 0; i < fields.size(); at += r.lengths[i++])
+      fields[i] = {r.text.data() + at, r.lengths[i]};
+
+    if (r.client != 0) {
+      std::array<char, INET_ADDRSTRLEN> ip;
+      inet_ntop(AF_INET, &r.client, ip.data(), ip.size());
+      out.append(ip.data());
+    } else {
+      out.push_back('-');
+    }
+
+    out.append(" - - ");
+    out.append(time.of(r.time));
+    out.append(" \"");
+    append_escaped(out, fields[0]);
+    out.push_back(' ');
+    append_escaped(out, fields[1]);
+    out.push_back(' ');
+    append_escaped(out, fields[2]);
+    out.append("\" ");
+    append_number(out, r.status);
+    out.push_back(' ');
+    append_number(out, r.bytes);
+
+    if (type == format::combined) {
+      out.append(" \"");
+      append_escaped(out, fields[3]);
+      out.append("\" \"");
+      append_escaped(out, fields[4]);
+      out.push_back('"');
+    }
+
+    // seconds with microseconds
+    out.push_back(' ');
+    append_number(out, r.latency / 1'000'000'000);
+    out.push_back('.');
+    auto micros = std::to_string(r.latency / 1000 % 1'000'000);
+    out.append(6 - micros.size(), '0').append(micros);
+    out.push_back('\n');
+  };
+
+  while (true) {
+    std::size_t count = 0;
+    for (; count < max_batch; ++count, ++head) {
+      auto &s = slots[head & mask];
+      if (s.sequence.load(std::memory_order_acquire) != head + 1)
+        break;
+
+      format_line(s.data, lines[count]);
+
+      // free for the position one lap later
+      s.sequence.store(head + mask + 1, std::memory_order_release);
+    }
+
+    if (count == 0) {
+      // everything logged before the stop has been written
+      if (stop.stop_requested())
+        return;
+
+      std::this_thread::sleep_for(flush_interval);
+      continue;
+    }
+
+    buffers.clear();
+    for (std::size_t i = 0; i < count; ++i)
+      buffers.push_back({lines[i].data(), lines[i].size()});
+
+    std::span<iovec> left = buffers;
+    while (!left.empty()) {
+      ssize_t ret = writev(fd, left.data(),
+                           std::min<std::size_t>(left.size(), IOV_MAX));
+      if (ret == -1 && errno == EINTR)
+        continue;
+      if (ret == -1) {
+        dropped.fetch_add(left.size(), std::memory_order_relaxed);
+        count -= left.size();
+        break;
+      }
+
+      // drop the lines that were written, the last one may be partial
+      std::size_t done = ret;
+      while (!left.empty() && done >= left.front().iov_len) {
+        done -= left.front().iov_len;
+        left = left.subspan(1);
+      }
+
+      if (done > 0) {
+        left.front().iov_base = static_cast<char *>(left.front().iov_base) + done;
+        left.front().iov_len -= done;
+      }
+    }
+
+    written.fetch_add(count, std::memory_order_relaxed);
+  }
+}
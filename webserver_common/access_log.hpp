@@ -0,0 +1,139 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <span>
+#include <string_view>
+#include <thread>
+
+namespace http {
+/*
+access log written by a background thread
+
+requests are pushed into a bounded lock-free ring (any number of threads
+may log at once, the writer is the only consumer) and the writer formats
+them and appends them to the file with writev in batches, so a slow disk or
+terminal never blocks request handling: when the ring is full the record is
+dropped and counted instead
+
+lines are in the Common or Combined Log Format followed by the time it took
+to serve the request in seconds
+*/
+class access_log {
+public:
+  enum class format { common, combined };
+
+  // what a request is logged with (the strings are copied, long ones are
+  //  cut off)
+  struct entry {
+    std::uint32_t client = 0; // IPv4 address (network order)
+    std::string_view method;
+    std::string_view target;
+    std::string_view version;
+    std::string_view referer;    // combined format only
+    std::string_view user_agent; // combined format only
+    int status = 0;
+    std::uint64_t bytes = 0; // sent for the response (headers included)
+    std::chrono::nanoseconds latency{};
+    std::chrono::system_clock::time_point time;
+  };
+
+  struct statistics {
+    std::uint64_t written = 0;
+    std::uint64_t dropped = 0; // ring full (or the write failed)
+  };
+
+  // "-" is the standard output, capacity is rounded up to a power of two
+  // throws std::system_error if the file cannot be opened
+  access_log(const std::filesystem::path &path, format type,
+             std::size_t capacity = 8192);
+  access_log(const access_log &) = delete;
+  access_log &operator=(const access_log &) = delete;
+
+  // stops the writer after it wrote what was logged
+  ~access_log();
+
+  // never blocks, false if the record was dropped
+  bool log(const entry &e);
+
+  // request (a whole head) is parsed again for its request line, Referer
+  //  and User-Agent (none if it is malformed)
+  bool log(std::uint32_t client, std::string_view request, int status,
+           std::uint64_t bytes, std::chrono::nanoseconds latency,
+           std::chrono::system_clock::time_point time);
+
+  // a line for each answered request of a batch that started to come in at
+  //  start, responses are the {http::response, keep_alive} pairs of the
+  //  server and the bytes sent are handed out to them in order
+  template <typename Responses>
+  void log_batch(std::uint32_t client,
+                 std::span<const std::string_view> requests,
+                 const Responses &responses, std::uint64_t sent,
+                 std::chrono::steady_clock::time_point start) {
+    auto latency = std::chrono::steady_clock::now() - start;
+    auto received = std::chrono::system_clock::now() -
+                    std::chrono::duration_cast<
+                        std::chrono::system_clock::duration>(latency);
+
+    std::size_t i = 0;
+    for (const auto &answered : responses) {
+      const auto &response = answered.first;
+
+      std::uint64_t size =
+          response.head.size() + response.body.size() + response.tail.size();
+      for (const auto &part : response.parts)
+        size += part.prefix.size() + part.length;
+
+      std::uint64_t bytes = std::min(size, sent);
+      sent -= bytes;
+      log(client, requests[i++], response.status, bytes, latency, received);
+    }
+  }
+
+  statistics stats() const;
+
+private:
+  // fixed size so that logging does not allocate
+  struct record {
+    std::int64_t time = 0;    // system clock, seconds
+    std::int64_t latency = 0; // nanoseconds
+    std::uint64_t bytes = 0;
+    std::uint32_t client = 0;
+    std::uint16_t status = 0;
+
+    // method, target, version, referer and user agent one after another
+    std::array<std::uint16_t, 5> lengths{};
+    std::array<char, 480> text;
+  };
+
+  // ring slot: sequence says whose turn it is (bounded MPMC queue with a
+  //  single consumer)
+  struct alignas(64) slot {
+    std::atomic<std::size_t> sequence;
+    record data;
+  };
+
+  void run(std::stop_token stop);
+
+  const format type;
+  int fd = -1;
+  bool owns_fd = false;
+
+  const std::size_t mask;
+  std::unique_ptr<slot[]> slots;
+
+  alignas(64) std::atomic<std::size_t> tail = 0; // next slot to fill
+  alignas(64) std::size_t head = 0;              // next slot to write (writer)
+
+  std::atomic<std::uint64_t> written = 0;
+  std::atomic<std::uint64_t> dropped = 0;
+
+  std::jthread writer;
+};
+} // namespace http
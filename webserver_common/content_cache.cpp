@@ -0,0 +1,240 @@
+#include "content_cache.hpp"
+
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <system_error>
+#include <vector>
+
+using namespace http;
+
+namespace {
+constexpr std::uint32_t watch_mask =
+    IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+
+std::string_view parent_of(std::string_view path) {
+  auto pos = path.find_last_of('/');
+  return pos == std::string_view::npos ? "." : path.substr(0, pos);
+}
+
+// without empty, "." and ".." components, so that each directory has one
+//  spelling (inotify events are mapped back to paths through it)
+bool is_canonical(std::string_view path) {
+  for (std::size_t begin = 0; begin <= path.size();) {
+    auto end = std::min(path.find('/', begin), path.size());
+    auto part = path.substr(begin, end - begin);
+    if ((part.empty() && begin != 0) || part == "." || part == "..")
+      return false;
+    begin = end + 1;
+  }
+  return true;
+}
+} // namespace
+
+content_cache::content_cache(std::size_t byte_budget, int inotify_fd,
+                             std::size_t max_entry_size)
+    : budget(byte_budget), max_entry(std::min(max_entry_size, byte_budget)),
+      notify_fd(inotify_fd) {}
+
+bool content_cache::matches(const entry &value, const struct stat &st) {
+  return value.inode == st.st_ino && value.size == st.st_size &&
+         value.mtime.tv_sec == st.st_mtim.tv_sec &&
+         value.mtime.tv_nsec == st.st_mtim.tv_nsec;
+}
+
+std::shared_ptr<const content_cache::entry>
+content_cache::find(const std::string &path) {
+  std::shared_ptr<const entry> value;
+
+  {
+    std::lock_guard lock(mutex);
+    auto it = index.find(path);
+    if (it == index.end()) {
+      ++counters.misses;
+      return nullptr;
+    }
+
+    // with inotify the entry is valid as long as it is in the cache
+    lru.splice(lru.begin(), lru, it->second);
+    value = it->second->value;
+    if (notify_fd != -1) {
+      ++counters.hits;
+      return value;
+    }
+  }
+
+  struct stat st;
+  bool valid = ::stat(path.c_str(), &st) == 0 && matches(*value, st);
+
+  std::lock_guard lock(mutex);
+  if (valid) {
+    ++counters.hits;
+    return value;
+  }
+
+  // somebody may have replaced the entry in the meantime
+  if (auto it = index.find(path);
+      it != index.end() && it->second->value == value) {
+    erase(it->second);
+    ++counters.invalidations;
+  }
+
+  ++counters.misses;
+  return nullptr;
+}
+
+content_cache::ticket content_cache::prepare(std::string_view path) {
+  if (notify_fd == -1 || !is_canonical(path))
+    return 0;
+
+  // a failed watch makes insert() drop the entry
+  std::lock_guard lock(mutex);
+  watch_directory(parent_of(path));
+  return generation;
+}
+
+void content_cache::insert(std::string_view path,
+                           std::shared_ptr<const entry> value,
+                           ticket taken) {
+  std::size_t size = path.size() + value->data.size();
+  if (value->data.size() > max_entry || size > budget || !is_canonical(path))
+    return;
+
+  std::lock_guard lock(mutex);
+
+  // changes of files in unwatched directories would go unnoticed, the file
+  //  may have been read before a change that was already processed
+  if (notify_fd != -1) {
+    auto it = watched_directories.find(std::string(parent_of(path)));
+    if (it == watched_directories.end() || it->second.changed > taken)
+      return;
+  }
+
+  if (auto it = index.find(path); it != index.end())
+    erase(it->second);
+
+  while (bytes + size > budget) {
+    erase(std::prev(lru.end()));
+    ++counters.evictions;
+  }
+
+  lru.push_front({std::string(path), std::move(value)});
+  index.emplace(lru.front().path, lru.begin());
+  bytes += size;
+  ++counters.insertions;
+}
+
+bool content_cache::watch_directory(std::string_view directory) {
+  std::string dir(directory);
+  if (watched_directories.contains(dir))
+    return true;
+
+  int wd = inotify_add_watch(notify_fd, dir.c_str(), watch_mask);
+  if (wd == -1)
+    return false;
+
+  // changes before the watch went unnoticed, older tickets are refused
+  watches[wd] = dir;
+  watched_directories[dir] = {wd, generation};
+  return true;
+}
+
+void content_cache::erase(lru_list::iterator it) {
+  bytes -= it->path.size() + it->value->data.size();
+  index.erase(it->path);
+  lru.erase(it);
+}
+
+void content_cache::invalidate(std::string_view path) {
+  if (auto it = index.find(path); it != index.end()) {
+    erase(it->second);
+    ++counters.invalidations;
+  }
+}
+
+void content_cache::invalidate_directory(std::string_view directory) {
+  std::vector<std::string_view> paths;
+  for (const auto &n : lru)
+    if (parent_of(n.path) == directory)
+      paths.push_back(n.path);
+
+  for (auto path : paths)
+    invalidate(path);
+}
+
+void content_cache::process_notifications() {
+  if (notify_fd == -1)
+    return;
+
+  alignas(inotify_event) std::array<char, 4096> buffer;
+
+  while (true) {
+    ssize_t len = read(notify_fd, buffer.data(), buffer.size());
+    if (len == -1 && errno == EINTR)
+      continue;
+    if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+    if (len == -1)
+      throw std::system_error(errno, std::system_category(), "read(inotify)");
+    if (len == 0)
+      return;
+
+    std::lock_guard lock(mutex);
+
+    for (ssize_t off = 0; off < len;) {
+      const auto *event = reinterpret_cast<const inotify_event *>(&buffer[off]);
+      off += sizeof(inotify_event) + event->len;
+
+      ++generation;
+
+      // events were lost, nothing can be trusted anymore
+      if (event->mask & IN_Q_OVERFLOW) {
+        for (auto &[dir, watched] : watched_directories)
+          watched.changed = generation;
+
+        while (!lru.empty()) {
+          erase(lru.begin());
+          ++counters.invalidations;
+        }
+        continue;
+      }
+
+      auto it = watches.find(event->wd);
+      if (it == watches.end())
+        continue;
+
+      const std::string &dir = it->second;
+      if (auto watched = watched_directories.find(dir);
+          watched != watched_directories.end())
+        watched->second.changed = generation;
+
+      if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+        invalidate_directory(dir);
+
+        if (event->mask & IN_IGNORED) {
+          watched_directories.erase(dir);
+          watches.erase(it);
+        } else {
+          inotify_rm_watch(notify_fd, event->wd);
+        }
+        continue;
+      }
+
+      if (event->len != 0)
+        invalidate(dir + "/" + event->name);
+    }
+  }
+}
+
+content_cache::statistics content_cache::stats() const {
+  std::lock_guard lock(mutex);
+
+  statistics res = counters;
+  res.entries = index.size();
+  res.bytes = bytes;
+  return res;
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <sys/stat.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace http {
+/*
+byte-budgeted LRU cache of ready-to-send responses for static files, keyed
+by the path of the file (directory/host/normalized path)
+
+entries are invalidated either through inotify (the owner of the inotify fd
+passed to the constructor waits for it to become readable and calls
+process_notifications()) or, without an inotify fd, by comparing the
+inode/size/mtime of the file on every lookup
+
+with inotify an entry is inserted with the ticket taken before its file was
+opened and read: the directory is watched from then on and the entry is
+dropped if a change of the directory was processed in the meantime
+
+safe to use from multiple threads
+*/
+class content_cache {
+public:
+  struct entry {
+    // head (status line and headers without the empty line), "\r\n", body
+    std::string data;
+    std::size_t head_size = 0;
+
+    // file the entry was built from
+    ino_t inode = 0;
+    off_t size = 0;
+    timespec mtime{};
+
+    std::string_view head() const {
+      return std::string_view(data).substr(0, head_size);
+    }
+    std::string_view body() const {
+      return std::string_view(data).substr(head_size + 2);
+    }
+  };
+
+  struct statistics {
+    std::uint64_t hits = 0;
+    std::uint64_t misses = 0;
+    std::uint64_t insertions = 0;
+    std::uint64_t evictions = 0;     // dropped to stay within the budget
+    std::uint64_t invalidations = 0; // dropped because the file changed
+    std::size_t entries = 0;
+    std::size_t bytes = 0;
+  };
+
+  // files bigger than max_entry_size are never cached
+  explicit content_cache(std::size_t byte_budget, int inotify_fd = -1,
+                         std::size_t max_entry_size = 1 << 20);
+  content_cache(const content_cache &) = delete;
+  content_cache &operator=(const content_cache &) = delete;
+
+  std::size_t max_entry_size() const { return max_entry; }
+
+  // generation of the notifications when the file was about to be read
+  using ticket = std::uint64_t;
+
+  std::shared_ptr<const entry> find(const std::string &path);
+
+  // watches the directory of the path, taken before the file is read
+  ticket prepare(std::string_view path);
+
+  // paths with empty, "." or ".." components are not cached
+  void insert(std::string_view path, std::shared_ptr<const entry> value,
+              ticket taken);
+
+  // read pending inotify events (the fd has to be non-blocking)
+  void process_notifications();
+
+  statistics stats() const;
+
+  // whether an entry built from the file still describes it
+  static bool matches(const entry &value, const struct stat &st);
+
+private:
+  struct node {
+    std::string path;
+    std::shared_ptr<const entry> value;
+  };
+  using lru_list = std::list<node>;
+
+  bool watch_directory(std::string_view directory);
+  void erase(lru_list::iterator it);
+  void invalidate(std::string_view path);
+  void invalidate_directory(std::string_view directory);
+
+  const std::size_t budget;
+  const std::size_t max_entry;
+  const int notify_fd;
+
+  mutable std::mutex mutex;
+
+  // most recently used first, index keys point into node::path
+  lru_list lru;
+  std::unordered_map<std::string_view, lru_list::iterator> index;
+  std::size_t bytes = 0;
+
+  // inotify watch descriptor -> directory (and back with the generation
+  //  of its last change)
+  struct watched_directory {
+    int wd;
+    ticket changed;
+  };
+  std::unordered_map<int, std::string> watches;
+  std::unordered_map<std::string, watched_directory> watched_directories;
+
+  // bumped by every processed notification
+  ticket generation = 0;
+
+  statistics counters;
+};
+} // namespace http
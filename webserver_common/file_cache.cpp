@@ -0,0 +1,163 @@
+#include "file_cache.hpp"
+
+#include <fcntl.h>
+#include <linux/openat2.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <system_error>
+
+using namespace http;
+
+namespace {
+// glibc has no wrapper for openat2
+int open_beneath(int root, const char *path, std::uint64_t flags) {
+  open_how how{};
+  how.flags = flags;
+  how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+
+  while (true) {
+    int fd = static_cast<int>(
+        syscall(SYS_openat2, root, path, &how, sizeof(how)));
+
+    // a concurrent rename may make the kernel give up on the lookup
+    if (fd == -1 && (errno == EAGAIN || errno == EINTR))
+      continue;
+    return fd;
+  }
+}
+
+bool same_file(const struct stat &a, const struct stat &b) {
+  return a.st_dev == b.st_dev && a.st_ino == b.st_ino &&
+         a.st_mode == b.st_mode && a.st_size == b.st_size &&
+         a.st_mtim.tv_sec == b.st_mtim.tv_sec &&
+         a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+}
+} // namespace
+
+file_cache::entry::~entry() {
+  if (fd != -1)
+    close(fd);
+}
+
+file_cache::file_cache(mime_lookup mime_type_of, std::size_t capacity,
+                       std::chrono::milliseconds revalidate_after)
+    : mime_type_of(mime_type_of), capacity(capacity),
+      revalidate_after(revalidate_after) {}
+
+std::shared_ptr<const file_cache::entry>
+file_cache::resolve(int root, const char *path) const {
+  auto res = std::make_shared<entry>();
+
+  // O_NONBLOCK so that opening a fifo does not hang (regular files ignore it)
+  int fd = open_beneath(root, path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+  if (fd == -1) {
+    if (errno == ENOENT || errno == ENOTDIR)
+      return res;
+
+    // the path (or a symlink on it) leads outside of the root
+    if (errno == EXDEV || errno == ELOOP) {
+      res->type = entry::kind::forbidden;
+      return res;
+    }
+
+    throw std::system_error(errno, std::system_category(), "openat2");
+  }
+
+  res->fd = fd;
+  if (fstat(fd, &res->st) == -1)
+    throw std::system_error(errno, std::system_category(), "fstat");
+
+  if (S_ISDIR(res->st.st_mode)) {
+    res->type = entry::kind::directory;
+  } else if (S_ISREG(res->st.st_mode)) {
+    res->type = entry::kind::regular;
+    res->mime_type = mime_type_of(path);
+    return res;
+  }
+
+  // only regular files keep their fd (anything else is not served)
+  close(res->fd);
+  res->fd = -1;
+  return res;
+}
+
+std::shared_ptr<const file_cache::entry>
+file_cache::lookup(int root, const std::string &key, std::size_t prefix,
+                   bool revalidate) {
+  const char *path = key.c_str() + prefix;
+  auto now = clock::now();
+  std::shared_ptr<const entry> value;
+
+  {
+    std::lock_guard lock(mutex);
+    if (auto it = index.find(key); it != index.end()) {
+      lru.splice(lru.begin(), lru, it->second);
+      value = it->second->value;
+
+      if (!revalidate && now - it->second->validated < revalidate_after) {
+        ++counters.hits;
+        return value;
+      }
+    }
+  }
+
+  // a stat is enough to tell whether the entry still describes the file
+  //  (if the path now leads somewhere else openat2 decides again)
+  if (value) {
+    struct stat st;
+    bool valid =
+        value->type == entry::kind::missing
+            ? fstatat(root, path, &st, 0) == -1 && errno == ENOENT
+            : fstatat(root, path, &st, 0) == 0 && same_file(st, value->st);
+
+    if (valid) {
+      std::lock_guard lock(mutex);
+      if (auto it = index.find(key);
+          it != index.end() && it->second->value == value)
+        it->second->validated = now;
+
+      ++counters.revalidations;
+      return value;
+    }
+  }
+
+  value = resolve(root, path);
+
+  std::lock_guard lock(mutex);
+  ++counters.misses;
+  if (value->type != entry::kind::forbidden)
+    insert(key, value, now);
+  return value;
+}
+
+void file_cache::insert(std::string_view key,
+                        std::shared_ptr<const entry> value,
+                        clock::time_point now) {
+  if (capacity == 0)
+    return;
+
+  if (auto it = index.find(key); it != index.end()) {
+    it->second->value = std::move(value);
+    it->second->validated = now;
+    return;
+  }
+
+  if (lru.size() >= capacity) {
+    index.erase(lru.back().key);
+    lru.pop_back();
+    ++counters.evictions;
+  }
+
+  lru.push_front({std::string(key), std::move(value), now});
+  index.emplace(lru.front().key, lru.begin());
+}
+
+file_cache::statistics file_cache::stats() const {
+  std::lock_guard lock(mutex);
+
+  statistics res = counters;
+  res.entries = index.size();
+  return res;
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <sys/stat.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace http {
+/*
+bounded LRU cache of resolved paths: what is there (nothing, a directory or
+a regular file), its stat and MIME type and, for regular files, an open fd
+
+paths are opened beneath the root directory fd of their host with openat2
+(RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS), so they can not escape it
+
+an entry is trusted for revalidate_after, after that a single stat of the
+path tells whether it still describes the same file. Fds are closed when the
+last user of an evicted entry lets go of it
+
+safe to use from multiple threads
+*/
+class file_cache {
+public:
+  using mime_lookup = std::string_view (*)(std::string_view path);
+
+  struct entry {
+    // forbidden: the path leads outside of the root (never cached)
+    enum class kind { missing, forbidden, directory, regular };
+
+    entry() = default;
+    entry(const entry &) = delete;
+    entry &operator=(const entry &) = delete;
+    ~entry();
+
+    kind type = kind::missing;
+    int fd = -1; // regular files only
+    struct stat st {};
+    std::string_view mime_type;
+  };
+
+  struct statistics {
+    std::uint64_t hits = 0;          // no syscall at all
+    std::uint64_t revalidations = 0; // still valid after a stat
+    std::uint64_t misses = 0;        // path was opened
+    std::uint64_t evictions = 0;
+    std::size_t entries = 0;
+  };
+
+  // capacity 0 resolves every lookup without keeping anything
+  explicit file_cache(mime_lookup mime_type_of, std::size_t capacity = 256,
+                      std::chrono::milliseconds revalidate_after =
+                          std::chrono::seconds(1));
+  file_cache(const file_cache &) = delete;
+  file_cache &operator=(const file_cache &) = delete;
+
+  // key identifies the file (e.g. "directory/host/path"), the part of it
+  //  after prefix is the path relative to the root directory fd
+  // throws std::system_error if the path cannot be inspected
+  // revalidate skips the trust window (for a file read into a cache that
+  //  has to get the file the path names now)
+  std::shared_ptr<const entry> lookup(int root, const std::string &key,
+                                      std::size_t prefix,
+                                      bool revalidate = false);
+
+  statistics stats() const;
+
+private:
+  using clock = std::chrono::steady_clock;
+
+  struct node {
+    std::string key;
+    std::shared_ptr<const entry> value;
+    clock::time_point validated;
+  };
+  using lru_list = std::list<node>;
+
+  std::shared_ptr<const entry> resolve(int root, const char *path) const;
+  void insert(std::string_view key, std::shared_ptr<const entry> value,
+              clock::time_point now);
+
+  const mime_lookup mime_type_of;
+  const std::size_t capacity;
+  const clock::duration revalidate_after;
+
+  mutable std::mutex mutex;
+
+  // most recently used first, index keys point into node::key
+  lru_list lru;
+  std::unordered_map<std::string_view, lru_list::iterator> index;
+
+  statistics counters;
+};
+} // namespace http
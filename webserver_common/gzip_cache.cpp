@@ -0,0 +1,150 @@
+#include "gzip_cache.hpp"
+
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <stdexcept>
+#include <system_error>
+
+using namespace http;
+
+namespace {
+bool same_version(const gzip_cache::entry &value, const struct stat &st) {
+  return value.inode == st.st_ino && value.size == st.st_size &&
+         value.mtime.tv_sec == st.st_mtim.tv_sec &&
+         value.mtime.tv_nsec == st.st_mtim.tv_nsec;
+}
+
+// whole file, empty if it got shorter while reading it
+std::string read_file(int fd, std::size_t size) {
+  std::string data(size, '\0');
+
+  for (std::size_t offset = 0; offset < size;) {
+    ssize_t ret = pread(fd, data.data() + offset, size - offset, offset);
+    if (ret == -1 && errno == EINTR)
+      continue;
+    if (ret == -1)
+      throw std::system_error(errno, std::system_category(), "pread");
+    if (ret == 0)
+      return {};
+
+    offset += ret;
+  }
+
+  return data;
+}
+
+std::string gzip(std::string_view data, int level) {
+  z_stream stream{};
+  // 16 + 15: gzip header and trailer around a 32 KiB window deflate stream
+  if (deflateInit2(&stream, level, Z_DEFLATED, 16 + 15, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK)
+    throw std::runtime_error("deflateInit2 failed");
+
+  std::string res(deflateBound(&stream, data.size()), '\0');
+
+  stream.next_in =
+      reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+  stream.avail_in = data.size();
+  stream.next_out = reinterpret_cast<Bytef *>(res.data());
+  stream.avail_out = res.size();
+
+  int ret = deflate(&stream, Z_FINISH);
+  res.resize(stream.total_out);
+  deflateEnd(&stream);
+
+  if (ret != Z_STREAM_END)
+    throw std::runtime_error("deflate failed");
+
+  return res;
+}
+} // namespace
+
+gzip_cache::gzip_cache(std::size_t byte_budget, int level,
+                       std::size_t max_file_size)
+    : budget(byte_budget), level(level),
+      max_file(std::min(max_file_size, byte_budget)) {}
+
+std::shared_ptr<const gzip_cache::entry>
+gzip_cache::get(std::string_view key, int fd, const struct stat &st) {
+  if (static_cast<std::size_t>(st.st_size) > max_file)
+    return nullptr;
+
+  {
+    std::lock_guard lock(mutex);
+    if (auto it = index.find(key);
+        it != index.end() && same_version(*it->second->value, st)) {
+      lru.splice(lru.begin(), lru, it->second);
+      ++counters.hits;
+      return it->second->value;
+    }
+
+    ++counters.misses;
+  }
+
+  auto value = compress(fd, st);
+  if (value)
+    insert(key, value);
+
+  return value;
+}
+
+gzip_cache::statistics gzip_cache::stats() const {
+  std::lock_guard lock(mutex);
+  auto res = counters;
+  res.entries = index.size();
+  res.bytes = bytes;
+  return res;
+}
+
+std::shared_ptr<const gzip_cache::entry>
+gzip_cache::compress(int fd, const struct stat &st) const {
+  auto value = std::make_shared<entry>();
+  value->inode = st.st_ino;
+  value->size = st.st_size;
+  value->mtime = st.st_mtim;
+
+  std::string data = read_file(fd, st.st_size);
+
+  struct stat now;
+  if (data.size() != static_cast<std::size_t>(st.st_size) ||
+      fstat(fd, &now) == -1 || !same_version(*value, now))
+    return nullptr;
+
+  value->data = gzip(data, level);
+
+  // remembered (without the data) so that the file is not compressed again
+  if (value->data.size() >= data.size())
+    value->data.clear();
+
+  return value;
+}
+
+void gzip_cache::insert(std::string_view key,
+                        std::shared_ptr<const entry> value) {
+  std::size_t size = key.size() + value->data.size();
+  if (size > budget)
+    return;
+
+  std::lock_guard lock(mutex);
+
+  if (auto it = index.find(key); it != index.end())
+    erase(it->second);
+
+  while (bytes + size > budget) {
+    erase(std::prev(lru.end()));
+    ++counters.evictions;
+  }
+
+  lru.push_front({std::string(key), std::move(value)});
+  index.emplace(lru.front().key, lru.begin());
+  bytes += size;
+}
+
+void gzip_cache::erase(lru_list::iterator it) {
+  bytes -= it->key.size() + it->value->data.size();
+  index.erase(it->key);
+  lru.erase(it);
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <sys/stat.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace http {
+/*
+byte-budgeted LRU cache of files compressed with gzip on the fly, keyed like
+file_cache (directory/host/path)
+
+an entry belongs to the version of the file (inode/size/mtime) it was
+compressed from, asking for another version compresses the file again
+
+safe to use from multiple threads (files are compressed outside of the lock)
+*/
+class gzip_cache {
+public:
+  struct entry {
+    // gzip stream, empty if compression did not make the file smaller
+    std::string data;
+
+    // file the entry was built from
+    ino_t inode = 0;
+    off_t size = 0;
+    timespec mtime{};
+  };
+
+  struct statistics {
+    std::uint64_t hits = 0;
+    std::uint64_t misses = 0; // the file was compressed
+    std::uint64_t evictions = 0;
+    std::size_t entries = 0;
+    std::size_t bytes = 0;
+  };
+
+  // files bigger than max_file_size are never compressed, level is the zlib
+  //  compression level
+  explicit gzip_cache(std::size_t byte_budget, int level = 6,
+                      std::size_t max_file_size = 1 << 20);
+  gzip_cache(const gzip_cache &) = delete;
+  gzip_cache &operator=(const gzip_cache &) = delete;
+
+  // compressed copy of the regular file open as fd (with stat st), nullptr
+  //  if it is too big or changed while it was read
+  // throws std::system_error if the file cannot be read
+  std::shared_ptr<const entry> get(std::string_view key, int fd,
+                                   const struct stat &st);
+
+  statistics stats() const;
+
+private:
+  struct node {
+    std::string key;
+    std::shared_ptr<const entry> value;
+  };
+  using lru_list = std::list<node>;
+
+  std::shared_ptr<const entry> compress(int fd, const struct stat &st) const;
+  void insert(std::string_view key, std::shared_ptr<const entry> value);
+  void erase(lru_list::iterator it);
+
+  const std::size_t budget;
+  const int level;
+  const std::size_t max_file;
+
+  mutable std::mutex mutex;
+
+  // most recently used first, index keys point into node::key
+  lru_list lru;
+  std::unordered_map<std::string_view, lru_list::iterator> index;
+  std::size_t bytes = 0;
+
+  statistics counters;
+};
+} // namespace http
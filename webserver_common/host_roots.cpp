@@ -0,0 +1,41 @@
+#include "host_roots.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <system_error>
+
+using namespace http;
+
+host_roots::host_roots(const std::filesystem::path &directory) {
+  // prefixes in canonical form, content_cache only takes such paths
+  auto base = std::filesystem::canonical(directory);
+
+  for (const auto &dir : std::filesystem::directory_iterator(base)) {
+    if (!dir.is_directory())
+      continue;
+
+    int fd = open(dir.path().c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+      // the destructor does not run if the constructor throws
+      int err = errno;
+      for (auto &[host, root] : roots)
+        close(root.fd);
+      throw std::system_error(err, std::system_category(), "open");
+    }
+
+    roots.emplace(dir.path().filename().native(),
+                  root{fd, dir.path().native() + "/"});
+  }
+}
+
+host_roots::~host_roots() {
+  for (auto &[host, root] : roots)
+    close(root.fd);
+}
+
+const host_roots::root *host_roots::find(std::string_view host) const {
+  auto it = roots.find(host);
+  return it == roots.end() ? nullptr : &it->second;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace http {
+/*
+directory fds of the virtual hosts (subdirectories of the served directory),
+opened once at startup, files are then resolved beneath them with openat2
+(RESOLVE_BENEATH), which keeps requests inside the root of their host
+
+hosts created after startup are not served
+*/
+class host_roots {
+public:
+  struct root {
+    int fd = -1;
+    std::string prefix; // "/canonical/directory/host/", cache keys start with it
+  };
+
+  explicit host_roots(const std::filesystem::path &directory);
+  host_roots(const host_roots &) = delete;
+  host_roots &operator=(const host_roots &) = delete;
+  ~host_roots();
+
+  // root of the host (without the port), nullptr if there is none
+  const root *find(std::string_view host) const;
+
+private:
+  struct string_hash {
+    using is_transparent = void;
+    std::size_t operator()(std::string_view sv) const {
+      return std::hash<std::string_view>{}(sv);
+    }
+  };
+
+  std::unordered_map<std::string, root, string_hash, std::equal_to<>> roots;
+};
+} // namespace http
@@ -0,0 +1,176 @@
+#include "request_parser.hpp"
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+using namespace http;
+
+namespace {
+// first occurrence of a or b in [p, end), end if there is none
+const char *find_either(const char *p, const char *end, char a, char b) {
+#ifdef __AVX2__
+  {
+    const __m256i va = _mm256_set1_epi8(a);
+    const __m256i vb = _mm256_set1_epi8(b);
+
+    for (; end - p >= 32; p += 32) {
+      __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+      __m256i match = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, va),
+                                      _mm256_cmpeq_epi8(chunk, vb));
+
+      if (unsigned mask = _mm256_movemask_epi8(match))
+        return p + std::countr_zero(mask);
+    }
+  }
+#endif
+
+#ifdef __SSE2__
+  {
+    const __m128i va = _mm_set1_epi8(a);
+    const __m128i vb = _mm_set1_epi8(b);
+
+    for (; end - p >= 16; p += 16) {
+      __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+      __m128i match =
+          _mm_or_si128(_mm_cmpeq_epi8(chunk, va), _mm_cmpeq_epi8(chunk, vb));
+
+      if (unsigned mask = _mm_movemask_epi8(match))
+        return p + std::countr_zero(mask);
+    }
+  }
+#endif
+
+  for (; p != end; ++p)
+    if (*p == a || *p == b)
+      return p;
+
+  return end;
+}
+
+std::string_view view(const char *begin, const char *end) {
+  return {begin, static_cast<std::size_t>(end - begin)};
+}
+
+// strip optional whitespace (spaces and tabs)
+std::string_view trim(const char *begin, const char *end) {
+  auto space = [](char c) { return c == ' ' || c == '\t'; };
+
+  while (begin != end && space(*begin))
+    ++begin;
+  while (begin != end && space(end[-1]))
+    --end;
+
+  return view(begin, end);
+}
+} // namespace
+
+bool http::equal_ignoring_case(std::string_view a, std::string_view b) {
+  auto lower = [](char c) {
+    return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+  };
+
+  return a.size() == b.size() &&
+         std::equal(a.begin(), a.end(), b.begin(),
+                    [&](char x, char y) { return lower(x) == lower(y); });
+}
+
+std::string_view parsed_request::find(std::string_view name) const {
+  for (const auto &h : headers())
+    if (equal_ignoring_case(h.name, name))
+      return h.value;
+
+  return {};
+}
+
+bool http::parse_request(std::string_view data, parsed_request &out) {
+  const char *p = data.data();
+  const char *end = p + data.size();
+
+  out.header_count = 0;
+
+  // request line: three parts separated by single spaces
+  std::array<std::string_view, 3> parts;
+  for (std::size_t part = 0;; ++part) {
+    const char *at = find_either(p, end, ' ', '\r');
+    if (at == end || (*at == ' ') != (part < 2))
+      return false;
+
+    parts[part] = view(p, at);
+    p = at;
+    if (*at == '\r')
+      break;
+    ++p;
+  }
+
+  if (end - p < 2 || p[1] != '\n')
+    return false;
+  p += 2;
+
+  out.method = parts[0];
+  out.target = parts[1];
+  out.version = parts[2];
+
+  // headers up to the empty line
+  while (true) {
+    if (end - p < 2)
+      return false;
+    if (p[0] == '\r' && p[1] == '\n')
+      return true;
+
+    const char *colon = find_either(p, end, ':', '\r');
+    if (colon == end || *colon != ':')
+      return false;
+
+    const char *cr = find_either(colon + 1, end, '\r', '\r');
+    if (end - cr < 2 || cr[1] != '\n')
+      return false;
+
+    if (out.header_count == parsed_request::max_headers)
+      return false;
+
+    out.header_table[out.header_count++] = {trim(p, colon),
+                                            trim(colon + 1, cr)};
+    p = cr + 2;
+  }
+}
+
+std::size_t http::find_header_end(std::string_view data, std::size_t from) {
+  constexpr std::string_view terminator = "\r\n\r\n";
+
+  const char *begin = data.data();
+  const char *p = begin + std::min(from, data.size());
+  const char *end = begin + data.size();
+
+#ifdef __SSE2__
+  // compare 16 candidate positions at once (each of the 4 loads is shifted
+  //  by one byte, so a set bit means the whole terminator starts there)
+  const __m128i cr = _mm_set1_epi8('\r');
+  const __m128i lf = _mm_set1_epi8('\n');
+
+  auto load = [](const char *at) {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i *>(at));
+  };
+
+  for (; end - p >= 16 + 3; p += 16) {
+    __m128i match = _mm_and_si128(
+        _mm_and_si128(_mm_cmpeq_epi8(load(p), cr),
+                      _mm_cmpeq_epi8(load(p + 1), lf)),
+        _mm_and_si128(_mm_cmpeq_epi8(load(p + 2), cr),
+                      _mm_cmpeq_epi8(load(p + 3), lf)));
+
+    if (unsigned mask = _mm_movemask_epi8(match))
+      return p - begin + std::countr_zero(mask) + terminator.size();
+  }
+#endif
+
+  for (; end - p >= 4; ++p)
+    if (std::memcmp(p, terminator.data(), terminator.size()) == 0)
+      return p - begin + terminator.size();
+
+  return std::string_view::npos;
+}
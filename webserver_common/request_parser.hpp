@@ -0,0 +1,46 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <span>
+#include <string_view>
+
+namespace http {
+struct header {
+  std::string_view name;
+  std::string_view value; // without surrounding whitespace
+};
+
+// request line and headers of a request, all views point into the parsed
+//  data (nothing is allocated)
+struct parsed_request {
+  static constexpr std::size_t max_headers = 32;
+
+  std::string_view method;
+  std::string_view target;
+  std::string_view version;
+
+  std::array<header, max_headers> header_table;
+  std::size_t header_count = 0;
+
+  std::span<const header> headers() const {
+    return {header_table.data(), header_count};
+  }
+
+  // value of the first header with the name (compared case-insensitively),
+  //  empty if there is none
+  std::string_view find(std::string_view name) const;
+};
+
+// parse "<method> <target> <version>\r\n(<name>: <value>\r\n)*\r\n" in a
+//  single pass (delimiters are searched with SSE2/AVX2 if available), data
+//  after the empty line is ignored
+// false if the request is malformed or has more than max_headers headers
+bool parse_request(std::string_view data, parsed_request &out);
+
+// ASCII case-insensitive comparison (header names, tokens)
+bool equal_ignoring_case(std::string_view a, std::string_view b);
+
+// position just past the first "\r\n\r\n" at or after `from` (npos if none)
+std::size_t find_header_end(std::string_view data, std::size_t from = 0);
+} // namespace http
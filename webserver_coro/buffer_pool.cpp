@@ -0,0 +1,68 @@
+#include "buffer_pool.hpp"
+
+#include <utility>
+
+using namespace io;
+
+buffer_pool::buffer &
+buffer_pool::buffer::operator=(buffer &&other) noexcept {
+  if (this != &other) {
+    if (memory)
+      pool->release(std::move(memory));
+
+    pool = std::exchange(other.pool, nullptr);
+    memory = std::move(other.memory);
+  }
+
+  return *this;
+}
+
+buffer_pool::buffer::~buffer() {
+  if (memory)
+    pool->release(std::move(memory));
+}
+
+std::span<char> buffer_pool::buffer::span() const {
+  if (!memory)
+    return {};
+
+  return {memory.get(), pool->size};
+}
+
+buffer_pool::buffer_pool(std::size_t buffer_size, std::size_t max_cached)
+    : size(buffer_size), max_cached(max_cached) {}
+
+buffer_pool::buffer buffer_pool::acquire() {
+  acquired.fetch_add(1, std::memory_order_relaxed);
+
+  auto used = in_use.fetch_add(1, std::memory_order_relaxed) + 1;
+  if (used > peak_in_use.load(std::memory_order_relaxed))
+    peak_in_use.store(used, std::memory_order_relaxed);
+
+  if (free_list.empty()) {
+    allocated.fetch_add(1, std::memory_order_relaxed);
+    return buffer(this, std::make_unique_for_overwrite<char[]>(size));
+  }
+
+  auto memory = std::move(free_list.back());
+  free_list.pop_back();
+  cached.store(free_list.size(), std::memory_order_relaxed);
+  return buffer(this, std::move(memory));
+}
+
+buffer_pool::statistics buffer_pool::stats() const {
+  return {acquired.load(std::memory_order_relaxed),
+          allocated.load(std::memory_order_relaxed),
+          in_use.load(std::memory_order_relaxed),
+          peak_in_use.load(std::memory_order_relaxed),
+          cached.load(std::memory_order_relaxed)};
+}
+
+void buffer_pool::release(std::unique_ptr<char[]> memory) {
+  in_use.fetch_sub(1, std::memory_order_relaxed);
+
+  if (free_list.size() < max_cached) {
+    free_list.push_back(std::move(memory));
+    cached.store(free_list.size(), std::memory_order_relaxed);
+  }
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <vector>
+
+namespace io {
+/*
+fixed-size connection buffers of one event loop
+
+a connection holds a buffer only while it reads a request, so the memory
+of a loop is bounded by buffer_size times the connections that are in the
+middle of a request (idle keep-alive connections hold none). Released
+buffers are recycled through a free list of at most max_cached buffers
+
+buffers are acquired and released by the thread of the loop only, stats()
+can be called from any thread
+*/
+class buffer_pool {
+public:
+  struct statistics {
+    std::uint64_t acquired = 0;
+    std::uint64_t allocated = 0; // not served from the free list
+    std::size_t in_use = 0;
+    std::size_t peak_in_use = 0;
+    std::size_t cached = 0;
+  };
+
+  // move-only, goes back to its pool when destroyed
+  class buffer {
+  public:
+    buffer() = default;
+    buffer(buffer &&other) noexcept = default;
+    buffer &operator=(buffer &&other) noexcept;
+    ~buffer();
+
+    explicit operator bool() const { return memory != nullptr; }
+    std::span<char> span() const;
+
+  private:
+    friend class buffer_pool;
+    buffer(buffer_pool *pool, std::unique_ptr<char[]> memory)
+        : pool(pool), memory(std::move(memory)) {}
+
+    buffer_pool *pool = nullptr;
+    std::unique_ptr<char[]> memory;
+  };
+
+  explicit buffer_pool(std::size_t buffer_size, std::size_t max_cached = 1024);
+  buffer_pool(const buffer_pool &) = delete;
+  buffer_pool &operator=(const buffer_pool &) = delete;
+
+  std::size_t buffer_size() const { return size; }
+
+  buffer acquire();
+
+  statistics stats() const;
+
+private:
+  void release(std::unique_ptr<char[]> memory);
+
+  const std::size_t size;
+  const std::size_t max_cached;
+
+  std::vector<std::unique_ptr<char[]>> free_list;
+
+  // only written by the thread of the loop, read by stats()
+  std::atomic<std::uint64_t> acquired = 0;
+  std::atomic<std::uint64_t> allocated = 0;
+  std::atomic<std::size_t> in_use = 0;
+  std::atomic<std::size_t> peak_in_use = 0;
+  std::atomic<std::size_t> cached = 0;
+};
+} // namespace io
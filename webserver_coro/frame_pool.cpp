@@ -0,0 +1,165 @@
+#include "frame_pool.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <vector>
+
+using namespace coro;
+
+namespace {
+constexpr std::size_t class_count =
+    frame_pool::max_pooled_size / frame_pool::granularity;
+
+std::size_t class_of(std::size_t size) {
+  return (size + frame_pool::granularity - 1) / frame_pool::granularity - 1;
+}
+
+// only the owning thread writes, so plain load + store is enough (other
+//  threads read them when aggregating)
+void bump(std::atomic<std::uint64_t> &counter, std::uint64_t by = 1) {
+  counter.store(counter.load(std::memory_order_relaxed) + by,
+                std::memory_order_relaxed);
+}
+
+struct local_pool;
+
+struct registry {
+  std::mutex mutex;
+  std::vector<const local_pool *> pools;
+  frame_pool::statistics retired;
+};
+
+registry &get_registry() {
+  static registry instance;
+  return instance;
+}
+
+struct local_pool {
+  struct free_block {
+    free_block *next;
+  };
+
+  std::array<free_block *, class_count> free_lists{};
+  std::size_t cached_bytes = 0;
+
+  std::atomic<std::uint64_t> allocations = 0;
+  std::atomic<std::uint64_t> pool_hits = 0;
+  std::atomic<std::uint64_t> heap_allocations = 0;
+  std::atomic<std::size_t> bytes_in_use = 0;
+  std::atomic<std::size_t> peak_bytes = 0;
+
+  local_pool() {
+    auto &reg = get_registry();
+    std::lock_guard lock(reg.mutex);
+    reg.pools.push_back(this);
+  }
+
+  ~local_pool() {
+    {
+      auto &reg = get_registry();
+      std::lock_guard lock(reg.mutex);
+      std::erase(reg.pools, this);
+      add_to(reg.retired);
+    }
+
+    for (auto *&head : free_lists) {
+      while (head) {
+        auto *next = head->next;
+        ::operator delete(head);
+        head = next;
+      }
+    }
+  }
+
+  void add_to(frame_pool::statistics &stats) const {
+    stats.allocations += allocations.load(std::memory_order_relaxed);
+    stats.pool_hits += pool_hits.load(std::memory_order_relaxed);
+    stats.heap_allocations += heap_allocations.load(std::memory_order_relaxed);
+    stats.bytes_in_use += bytes_in_use.load(std::memory_order_relaxed);
+    stats.peak_bytes += peak_bytes.load(std::memory_order_relaxed);
+  }
+
+  void track(std::size_t size) {
+    bump(allocations);
+    std::size_t in_use = bytes_in_use.load(std::memory_order_relaxed) + size;
+    bytes_in_use.store(in_use, std::memory_order_relaxed);
+    if (in_use > peak_bytes.load(std::memory_order_relaxed))
+      peak_bytes.store(in_use, std::memory_order_relaxed);
+  }
+
+  void *allocate(std::size_t size) {
+    if (size > frame_pool::max_pooled_size) {
+      track(size);
+      bump(heap_allocations);
+      return ::operator new(size);
+    }
+
+    std::size_t cls = class_of(size);
+    std::size_t block_size = (cls + 1) * frame_pool::granularity;
+    track(block_size);
+
+    if (auto *block = free_lists[cls]) {
+      free_lists[cls] = block->next;
+      cached_bytes -= block_size;
+      bump(pool_hits);
+      return block;
+    }
+
+    bump(heap_allocations);
+    return ::operator new(block_size);
+  }
+
+  void deallocate(void *ptr, std::size_t size) noexcept {
+    std::size_t block_size =
+        size > frame_pool::max_pooled_size
+            ? size
+            : (class_of(size) + 1) * frame_pool::granularity;
+
+    // frames may be released by a different thread than the one that
+    //  allocated them (after hopping through thread_pool), the block then
+    //  simply moves to this thread's cache
+    std::size_t in_use = bytes_in_use.load(std::memory_order_relaxed);
+    bytes_in_use.store(in_use - std::min(in_use, block_size),
+                       std::memory_order_relaxed);
+
+    if (size > frame_pool::max_pooled_size ||
+        cached_bytes + block_size > frame_pool::max_cached_bytes) {
+      ::operator delete(ptr);
+      return;
+    }
+
+    std::size_t cls = class_of(size);
+    auto *block = static_cast<free_block *>(ptr);
+    block->next = free_lists[cls];
+    free_lists[cls] = block;
+    cached_bytes += block_size;
+  }
+};
+
+local_pool &get_local_pool() {
+  thread_local local_pool pool;
+  return pool;
+}
+} // namespace
+
+void *frame_pool::allocate(std::size_t size) {
+  return get_local_pool().allocate(size);
+}
+
+void frame_pool::deallocate(void *ptr, std::size_t size) noexcept {
+  get_local_pool().deallocate(ptr, size);
+}
+
+frame_pool::statistics frame_pool::stats() {
+  auto &reg = get_registry();
+  std::lock_guard lock(reg.mutex);
+
+  statistics res = reg.retired;
+  for (auto *pool : reg.pools)
+    pool->add_to(res);
+
+  return res;
+}
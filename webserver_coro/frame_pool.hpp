@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace coro {
+/*
+thread-local, size-classed free lists for coroutine frames
+
+frames up to max_pooled_size are rounded up to a multiple of granularity and
+recycled through the free list of the thread that releases them, bigger ones
+(and allocations when the cache is over budget) go to the general heap
+*/
+namespace frame_pool {
+inline constexpr std::size_t granularity = 64;
+inline constexpr std::size_t max_pooled_size = 4096;
+
+// bytes a single thread keeps cached in its free lists
+inline constexpr std::size_t max_cached_bytes = 4 << 20;
+
+struct statistics {
+  std::uint64_t allocations = 0;
+  std::uint64_t pool_hits = 0; // served from a free list
+  std::uint64_t heap_allocations = 0;
+  std::size_t bytes_in_use = 0;
+  std::size_t peak_bytes = 0; // sum of per-thread peaks
+
+  double hit_rate() const {
+    return allocations == 0 ? 0.0
+                            : static_cast<double>(pool_hits) / allocations;
+  }
+};
+
+void *allocate(std::size_t size);
+void deallocate(void *ptr, std::size_t size) noexcept;
+
+// aggregated over all threads (including the ones that already exited)
+statistics stats();
+} // namespace frame_pool
+
+namespace detail {
+// base of promise types, makes their frames come from the frame pool
+struct pooled_frame {
+  static void *operator new(std::size_t size) {
+    return frame_pool::allocate(size);
+  }
+  static void operator delete(void *ptr, std::size_t size) noexcept {
+    frame_pool::deallocate(ptr, size);
+  }
+};
+} // namespace detail
+} // namespace coro
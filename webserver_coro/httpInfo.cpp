@@ -2,69 +2,501 @@
 
 #include "utils.hpp"
 
+#include <unistd.h>
+#include <sys/stat.h>
+
 #include <algorithm>
-#include <fstream>
+#include <array>
+#include <charconv>
+#include <ctime>
+#include <limits>
+#include <optional>
 #include <ranges>
 #include <string>
+#include <system_error>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 
 using namespace http;
 
-std::string r200::content() const {
-  // get content of the file
-  std::ifstream file(file_path, std::ios::binary);
-  file.exceptions(std::ios::badbit | std::ios::failbit);
+namespace {
+// separates the parts of multipart/byteranges responses
+constexpr std::string_view boundary = "3f0c9a7be21d4586";
+constexpr std::size_t max_ranges = 16;
 
-  return {std::istreambuf_iterator<char>(file),
-          std::istreambuf_iterator<char>()};
+std::string content_range(byte_range range, off_t size) {
+  return "bytes " + std::to_string(range.first) + "-" +
+         std::to_string(range.last) + "/" + std::to_string(size);
 }
 
-std::string_view r200::mime_type() const {
-  // get mime_type type of the file
-  if (auto it = std::ranges::find(http::mime_types, file_path.extension(),
-                                  &http::mime_type::extension);
-      it != http::mime_types.end())
-    return it->type;
+// whole string as a non-negative number
+std::optional<off_t> parse_offset(std::string_view sv) {
+  off_t value;
+  auto [end, ec] = std::from_chars(sv.data(), sv.data() + sv.size(), value);
+  if (ec != std::errc() || end != sv.data() + sv.size() || sv.empty() ||
+      value < 0)
+    return std::nullopt;
+  return value;
+}
+
+std::string_view trim(std::string_view sv) {
+  sv.remove_prefix(std::min(sv.find_first_not_of(" \t"), sv.size()));
+  return sv.substr(0, sv.find_last_not_of(" \t") + 1);
+}
+
+// read the whole file into a cache entry behind the head (nullptr if the
+//  file changed while reading it)
+std::shared_ptr<content_cache::entry>
+read_entry(std::string head, int file, const struct stat &st) {
+  auto entry = std::make_shared<content_cache::entry>();
+  entry->head_size = head.size();
+  entry->data = std::move(head);
+  entry->data.append("\r\n");
+
+  std::size_t offset = entry->data.size();
+  entry->data.resize(offset + st.st_size);
+
+  while (offset < entry->data.size()) {
+    ssize_t ret = pread(file, entry->data.data() + offset,
+                        entry->data.size() - offset,
+                        offset - entry->head_size - 2);
+    if (ret == -1 && errno == EINTR)
+      continue;
+    if (ret == -1)
+      utils::throw_sys_error("pread");
+    if (ret == 0)
+      return nullptr;
+
+    offset += ret;
+  }
+
+  entry->inode = st.st_ino;
+  entry->size = st.st_size;
+  entry->mtime = st.st_mtim;
+
+  struct stat now;
+  if (fstat(file, &now) == -1 || !content_cache::matches(*entry, now))
+    return nullptr;
+
+  return entry;
+}
+} // namespace
+
+std::string_view http::mime_type_of(std::string_view path) {
+  auto name = path.substr(path.find_last_of('/') + 1);
+  auto dot = name.find_last_of('.');
+
+  // a leading dot does not start an extension
+  if (dot != std::string_view::npos && dot != 0)
+    if (auto it = std::ranges::find(mime_types, name.substr(dot),
+                                    &mime_type::extension);
+        it != mime_types.end())
+      return it->type;
 
   return "application/octet-stream";
 }
 
-std::string http::get_response(std::string_view version, const request &resp) {
-  std::string response;
-  response.reserve(1024);
+bool http::is_compressible(std::string_view type) {
+  auto it = std::ranges::find(mime_types, type, &mime_type::type);
+  return it != mime_types.end() && it->compressible;
+}
+
+validators validators::of(ino_t inode, off_t size, timespec mtime) {
+  std::string etag;
+  etag.reserve(2 + 4 * 16 + 3);
 
-  auto append = [&](std::string_view header, std::string_view value) {
-    response.append(header);
-    response.append(": ");
-    response.append(value);
-    response.append("\r\n");
+  auto hex = [&](auto value) {
+    std::array<char, 16> digits; // a 64-bit value has at most 16
+    auto [end, ec] = std::to_chars(digits.data(), digits.data() + digits.size(),
+                                   static_cast<std::uint64_t>(value), 16);
+    if (ec != std::errc())
+      throw std::system_error(std::make_error_code(ec), "validators::of");
+    etag.append(digits.data(), end);
   };
 
-  std::visit(
-      [&](auto &data) {
-        response.append(version);
-        response.append(" ");
-        response.append(data.header());
-        response.append("\r\n");
+  etag.push_back('"');
+  hex(inode);
+  etag.push_back('-');
+  hex(size);
+  etag.push_back('-');
+  hex(mtime.tv_sec);
+  etag.push_back('.');
+  hex(mtime.tv_nsec);
+  etag.push_back('"');
+
+  return {std::move(etag), mtime.tv_sec};
+}
+
+std::string http::http_date(time_t time) {
+  std::tm tm;
+  gmtime_r(&time, &tm);
+
+  std::array<char, 64> buffer;
+  std::size_t size = std::strftime(buffer.data(), buffer.size(),
+                                   "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  return std::string(buffer.data(), size);
+}
+
+std::optional<r304> http::check_not_modified(const parsed_request &req,
+                                             validators file) {
+  std::string_view if_none_match = req.find("If-None-Match");
+  std::string_view if_modified_since = req.find("If-Modified-Since");
+  if (if_none_match.empty() && if_modified_since.empty())
+    return std::nullopt;
+
+  // a list of (weakly compared) entity tags, it overrides If-Modified-Since
+  if (!if_none_match.empty()) {
+    for (auto tag : std::views::split(if_none_match, ',')) {
+      auto sv = trim(std::string_view(tag.begin(), tag.end()));
+      if (sv.starts_with("W/"))
+        sv.remove_prefix(2);
+
+      if (sv == "*" || sv == file.etag)
+        return r304{{}, std::move(file)};
+    }
+
+    return std::nullopt;
+  }
+
+  // dates in the obsolete formats are ignored
+  std::string date(if_modified_since);
+  std::tm tm{};
+  const char *end = strptime(date.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  if (!end || *end != '\0')
+    return std::nullopt;
+
+  if (file.mtime <= timegm(&tm))
+    return r304{{}, std::move(file)};
+
+  return std::nullopt;
+}
+
+accept_encoding accept_encoding::of(const parsed_request &req) {
+  // codings listed by name win over "*"
+  std::optional<bool> br, gzip, any;
+
+  for (auto item : std::views::split(req.find("Accept-Encoding"), ',')) {
+    auto sv = std::string_view(item.begin(), item.end());
+    auto semicolon = sv.find(';');
+    auto coding = trim(sv.substr(0, semicolon));
+
+    // q=0 (q=0.0, q=0.00, ...) means "not acceptable"
+    bool accepted = true;
+    if (semicolon != std::string_view::npos) {
+      auto param = trim(sv.substr(semicolon + 1));
+      if (param.starts_with("q=") || param.starts_with("Q="))
+        accepted = param.find_first_not_of("0.", 2) != std::string_view::npos;
+    }
+
+    if (equal_ignoring_case(coding, "br"))
+      br = accepted;
+    else if (equal_ignoring_case(coding, "gzip") ||
+             equal_ignoring_case(coding, "x-gzip"))
+      gzip = accepted;
+    else if (coding == "*")
+      any = accepted;
+  }
+
+  return {br.value_or(any.value_or(false)), gzip.value_or(any.value_or(false))};
+}
+
+std::optional<encoded_file>
+http::select_encoding(accept_encoding codings, file_cache &files,
+                      gzip_cache *gzip, int root, std::string_view key,
+                      std::size_t prefix, const file_cache::entry &file) {
+  using kind = file_cache::entry::kind;
+
+  // a sidecar older than the file is a leftover of a previous version
+  auto sidecar = [&](std::string_view coding, std::string_view extension)
+      -> std::optional<encoded_file> {
+    thread_local std::string path;
+    path.assign(key);
+    path.append(extension);
+
+    auto entry = files.lookup(root, path, prefix);
+    const auto &st = entry->st;
+    if (entry->type != kind::regular ||
+        std::tie(st.st_mtim.tv_sec, st.st_mtim.tv_nsec) <
+            std::tie(file.st.st_mtim.tv_sec, file.st.st_mtim.tv_nsec))
+      return std::nullopt;
+
+    return encoded_file{coding,
+                        validators::of(st.st_ino, st.st_size, st.st_mtim),
+                        std::move(entry), nullptr};
+  };
+
+  if (codings.br)
+    if (auto res = sidecar("br", ".br"))
+      return res;
+
+  if (!codings.gzip)
+    return std::nullopt;
+
+  if (auto res = sidecar("gzip", ".gz"))
+    return res;
+
+  if (!gzip)
+    return std::nullopt;
+
+  auto compressed = gzip->get(key, file.fd, file.st);
+  if (!compressed || compressed->data.empty())
+    return std::nullopt;
+
+  // the same version of the file, but another representation of it
+  auto tag = validators::of(file.st.st_ino, file.st.st_size, file.st.st_mtim);
+  tag.etag.insert(tag.etag.size() - 1, "-gzip");
+
+  return encoded_file{"gzip", std::move(tag), nullptr, std::move(compressed)};
+}
 
-        append("Content-Type", data.mime_type());
-        append("Content-Length", std::to_string(data.content().size()));
+std::optional<std::vector<byte_range>>
+http::requested_ranges(const parsed_request &req, const struct stat &st) {
+  std::string_view header = req.find("Range");
+  if (header.empty())
+    return std::nullopt;
 
-        if (!resp.keep_alive)
-          append("Connection", "close");
-      },
-      resp.data);
+  // the ranges are only meant for the version of the file the client has
+  //  (entity tags are compared strongly, dates exactly)
+  if (auto if_range = req.find("If-Range"); !if_range.empty()) {
+    auto file = validators::of(st.st_ino, st.st_size, st.st_mtim);
+    if (if_range.starts_with('"') ? if_range != file.etag
+                                  : if_range != http_date(file.mtime))
+      return std::nullopt;
+  }
 
-  // return-code specific headers
-  std::visit(utils::overload{[&](const r301 &data) {
-                               append("Location", data.new_location);
-                             },
-                             [&](auto) {}},
-             resp.data);
+  constexpr std::string_view unit = "bytes=";
+  if (!header.starts_with(unit))
+    return std::nullopt;
+  header.remove_prefix(unit.size());
 
-  response.append("\r\n");
+  off_t size = st.st_size;
+  std::vector<byte_range> res;
+  std::size_t count = 0;
 
-  // content
-  std::visit([&](auto &data) { response.append(data.content()); }, resp.data);
+  for (auto part : std::views::split(header, ',')) {
+    auto spec = trim(std::string_view(part.begin(), part.end()));
+    if (spec.empty())
+      continue;
 
-  return response;
-}
\ No newline at end of file
+    // too many ranges are not worth it, send the whole file instead
+    if (++count > max_ranges)
+      return std::nullopt;
+
+    auto dash = spec.find('-');
+    if (dash == std::string_view::npos)
+      return std::nullopt;
+
+    auto first = spec.substr(0, dash);
+    auto last = spec.substr(dash + 1);
+
+    // "-n": the last n bytes
+    if (first.empty()) {
+      auto suffix = parse_offset(last);
+      if (!suffix)
+        return std::nullopt;
+
+      if (*suffix > 0 && size > 0)
+        res.push_back({size - std::min(*suffix, size), size - 1});
+      continue;
+    }
+
+    // "a-b" or "a-"
+    auto from = parse_offset(first);
+    auto to = last.empty() ? std::numeric_limits<off_t>::max()
+                           : parse_offset(last);
+    if (!from || !to || *to < *from)
+      return std::nullopt;
+
+    if (*from < size)
+      res.push_back({*from, std::min(*to, size - 1)});
+  }
+
+  if (count == 0)
+    return std::nullopt;
+
+  return res;
+}
+
+std::string_view r206::mime_type() const {
+  if (ranges.size() == 1)
+    return file->mime_type;
+
+  static const std::string multipart =
+      "multipart/byteranges; boundary=" + std::string(boundary);
+  return multipart;
+}
+
+std::string_view r200::mime_type() const {
+  if (file)
+    return file->mime_type;
+
+  return mime_type_of(file_path);
+}
+
+response http::get_response(std::string_view version, const request &req,
+                            content_cache *cache) {
+  response res;
+  res.status = std::visit([](const auto &data) { return data.code(); }, req.data);
+
+  // status line and the headers that do not depend on the connection
+  auto make_head = [&](const auto &data, std::size_t content_length) {
+    std::string head;
+    head.reserve(1024);
+
+    auto append = [&](std::string_view header, std::string_view value) {
+      head.append(header);
+      head.append(": ");
+      head.append(value);
+      head.append("\r\n");
+    };
+
+    head.append(version);
+    head.append(" ");
+    head.append(data.header());
+    head.append("\r\n");
+
+    using type = std::decay_t<decltype(data)>;
+
+    // a 304 has no body, its headers describe the 200 it stands for
+    if constexpr (!std::is_same_v<type, r304>) {
+      append("Content-Type", data.mime_type());
+      append("Content-Length", std::to_string(content_length));
+    }
+
+    auto append_validators = [&](const validators &file) {
+      append("ETag", file.etag);
+      append("Last-Modified", http_date(file.mtime));
+    };
+
+    // return-code specific headers
+    if constexpr (std::is_same_v<type, r200> || std::is_same_v<type, r206>) {
+      const auto &st = data.file->st;
+      auto tag = validators::of(st.st_ino, st.st_size, st.st_mtim);
+
+      if constexpr (std::is_same_v<type, r200>)
+        if (data.encoded) {
+          append("Content-Encoding", data.encoded->coding);
+          tag = data.encoded->tag;
+        }
+
+      append("Accept-Ranges", "bytes");
+      append_validators(tag);
+      if (is_compressible(data.file->mime_type))
+        append("Vary", "Accept-Encoding");
+    }
+    if constexpr (std::is_same_v<type, r206>)
+      if (data.ranges.size() == 1)
+        append("Content-Range",
+               content_range(data.ranges.front(), data.file->st.st_size));
+    if constexpr (std::is_same_v<type, r301>)
+      append("Location", data.new_location);
+    if constexpr (std::is_same_v<type, r304>) {
+      append_validators(data.file);
+      if (data.compressible)
+        append("Vary", "Accept-Encoding");
+    }
+    if constexpr (std::is_same_v<type, r416>)
+      append("Content-Range", "bytes */" + std::to_string(data.file_size));
+    if constexpr (std::is_same_v<type, r503>)
+      append("Retry-After", "1");
+
+    return head;
+  };
+
+  // r200 files are only read to fill the cache, otherwise just their size
+  //  (from the stat in the file cache) is needed for the headers
+  auto file_response = [&](const r200 &data) {
+    res.cached = data.cached;
+    if (res.cached)
+      return;
+
+    // copies from the gzip cache are sent from memory, sidecars like files
+    if (const auto &encoded = data.encoded) {
+      res.head = make_head(data, encoded->size());
+      res.compressed = encoded->compressed;
+      if (res.compressed)
+        res.body = res.compressed->data;
+
+      res.file = encoded->sidecar;
+      if (res.file)
+        res.parts.push_back({{}, 0, encoded->size()});
+      return;
+    }
+
+    std::size_t size = data.file->st.st_size;
+    res.file = data.file;
+    res.parts.push_back({{}, 0, size});
+    res.head = make_head(data, size);
+
+    if (!cache || size > cache->max_entry_size())
+      return;
+
+    if (auto entry = read_entry(res.head, res.file->fd, res.file->st)) {
+      cache->insert(data.file_path, entry, data.ticket);
+      res.cached = std::move(entry);
+      res.file = {};
+      res.parts.clear();
+    }
+  };
+
+  // ranges are sent straight from the file, several of them as
+  //  multipart/byteranges
+  auto range_response = [&](const r206 &data) {
+    res.file = data.file;
+
+    std::size_t content_length = 0;
+    for (auto range : data.ranges) {
+      std::string prefix;
+      if (data.ranges.size() > 1) {
+        prefix.append(res.parts.empty() ? "--" : "\r\n--");
+        prefix.append(boundary);
+        prefix.append("\r\nContent-Type: ");
+        prefix.append(data.file->mime_type);
+        prefix.append("\r\nContent-Range: ");
+        prefix.append(content_range(range, data.file->st.st_size));
+        prefix.append("\r\n\r\n");
+      }
+
+      content_length += prefix.size() + range.length();
+      res.parts.push_back({std::move(prefix), range.first, range.length()});
+    }
+
+    if (data.ranges.size() > 1) {
+      res.tail.append("\r\n--");
+      res.tail.append(boundary);
+      res.tail.append("--\r\n");
+      content_length += res.tail.size();
+    }
+
+    res.head = make_head(data, content_length);
+  };
+
+  std::string body;
+  std::visit(utils::overload{file_response, range_response,
+                             [&](const auto &data) {
+                               body = data.content();
+                               res.head = make_head(data, body.size());
+                             }},
+             req.data);
+
+  // cached responses are sent as they are on keep-alive connections
+  if (res.cached && req.keep_alive) {
+    res.head.clear();
+    res.body = res.cached->data;
+    return res;
+  }
+
+  if (res.cached) {
+    res.head = res.cached->head();
+    res.body = res.cached->body();
+  }
+
+  if (!req.keep_alive)
+    res.head.append("Connection: close\r\n");
+
+  res.head.append("\r\n");
+  res.head.append(body);
+
+  return res;
+}
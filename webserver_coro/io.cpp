@@ -1,6 +1,7 @@
 #include "io.hpp"
 
 #include <arpa/inet.h>
+#include <limits.h>
 
 #include <algorithm>
 #include <cstdint>
@@ -20,6 +21,23 @@ input_data io::parse_input(int argc, char *argv[]) {
     std::cerr << "Options:\n";
     std::cerr << "  --debug: enable debug mode\n";
     std::cerr << "  --quotes [ms]: enable inspirational quotes\n";
+    std::cerr << "  --backend <poll|epoll|io_uring>: select io_engine backend (default: io_uring)\n";
+    std::cerr << "  --threads <n>: run n pinned event loops (SO_REUSEPORT)\n";
+    std::cerr << "  --stats [ms]: periodically print per-thread counters\n";
+    std::cerr << "  --workers <n>: build responses on a pool of n threads\n";
+    std::cerr << "  --cache <MiB>: size of the static content cache (default: 32, 0 disables it)\n";
+    std::cerr << "  --open-files <n>: number of cached file descriptors (default: 256)\n";
+    std::cerr << "  --max-header-size <bytes>: size of connection buffers, bigger request heads get 431 (default: 8192)\n";
+    std::cerr << "  --header-timeout <s>: time to send a whole request head (default: 5)\n";
+    std::cerr << "  --idle-timeout <s>: close keep-alive connections idle for that long (default: 15)\n";
+    std::cerr << "  --backlog <n>: listen backlog (default: SOMAXCONN)\n";
+    std::cerr << "  --max-connections <n>: connections served at once, the rest waits in the backlog (default: 10000)\n";
+    std::cerr << "  --shed-lag <ms>: answer new connections with 503 while the loop lag is above this (default: 100, 0 disables it)\n";
+    std::cerr << "  --gzip <MiB>: gzip compressible files on the fly and keep up to MiB of them (default: 0, off)\n";
+    std::cerr << "  --metrics: serve Prometheus metrics at /__metrics\n";
+    std::cerr << "  --access-log <file|->: append an access log of every request to the file (or stdout)\n";
+    std::cerr << "  --log-format <common|combined>: format of the access log lines, followed by the latency in seconds (default: combined)\n";
+    std::cerr << "  --trace <n>: keep the last n request spans of every loop, SIGUSR1 dumps them as a Chrome trace (default: 0, off)\n";
     throw std::invalid_argument("Invalid number of arguments");
   }
 
@@ -37,6 +55,16 @@ input_data io::parse_input(int argc, char *argv[]) {
   }
 
   res.quote_interval = std::chrono::seconds(30);
+  res.stats_interval = std::chrono::seconds(10);
+
+  auto value_of = [&](int &i) -> std::string_view {
+    if (i + 1 >= argc) {
+      std::cerr << argv[i] << " requires an argument\n";
+      throw std::invalid_argument("Missing option argument");
+    }
+
+    return argv[++i];
+  };
 
   // rest of args are optional
   for (int i = 3; i < argc; ++i) {
@@ -54,6 +82,110 @@ input_data io::parse_input(int argc, char *argv[]) {
 
         res.quote_interval = std::chrono::milliseconds(std::stoi(argv[++i]));
       }
+    } else if (arg == "--backend") {
+      res.backend = coro::backend_from_string(value_of(i));
+    } else if (arg == "--threads") {
+      int threads = std::stoi(std::string(value_of(i)));
+      if (threads < 1) {
+        std::cerr << "--threads must be positive\n";
+        throw std::invalid_argument("Invalid thread count");
+      }
+
+      res.threads = threads;
+    } else if (arg == "--workers") {
+      int workers = std::stoi(std::string(value_of(i)));
+      if (workers < 0) {
+        std::cerr << "--workers must not be negative\n";
+        throw std::invalid_argument("Invalid worker count");
+      }
+
+      res.workers = workers;
+    } else if (arg == "--cache") {
+      int size = std::stoi(std::string(value_of(i)));
+      if (size < 0) {
+        std::cerr << "--cache must not be negative\n";
+        throw std::invalid_argument("Invalid cache size");
+      }
+
+      res.cache_size = static_cast<std::size_t>(size) << 20;
+    } else if (arg == "--open-files") {
+      int files = std::stoi(std::string(value_of(i)));
+      if (files < 0) {
+        std::cerr << "--open-files must not be negative\n";
+        throw std::invalid_argument("Invalid open file count");
+      }
+
+      res.open_files = files;
+    } else if (arg == "--gzip") {
+      int size = std::stoi(std::string(value_of(i)));
+      if (size < 0) {
+        std::cerr << "--gzip must not be negative\n";
+        throw std::invalid_argument("Invalid gzip cache size");
+      }
+
+      res.gzip_cache_size = static_cast<std::size_t>(size) << 20;
+    } else if (arg == "--max-header-size") {
+      int size = std::stoi(std::string(value_of(i)));
+      if (size < 64) {
+        std::cerr << "--max-header-size must be at least 64\n";
+        throw std::invalid_argument("Invalid header size");
+      }
+
+      res.max_header_size = size;
+    } else if (arg == "--header-timeout" || arg == "--idle-timeout") {
+      int seconds = std::stoi(std::string(value_of(i)));
+      if (seconds <= 0) {
+        std::cerr << arg << " must be positive\n";
+        throw std::invalid_argument("Invalid timeout");
+      }
+
+      (arg == "--header-timeout" ? res.header_timeout : res.idle_timeout) =
+          std::chrono::seconds(seconds);
+    } else if (arg == "--backlog" || arg == "--max-connections") {
+      int count = std::stoi(std::string(value_of(i)));
+      if (count <= 0) {
+        std::cerr << arg << " must be positive\n";
+        throw std::invalid_argument("Invalid connection count");
+      }
+
+      if (arg == "--backlog")
+        res.backlog = count;
+      else
+        res.max_connections = count;
+    } else if (arg == "--shed-lag") {
+      int ms = std::stoi(std::string(value_of(i)));
+      if (ms < 0) {
+        std::cerr << "--shed-lag must not be negative\n";
+        throw std::invalid_argument("Invalid loop lag");
+      }
+
+      res.shed_lag = std::chrono::milliseconds(ms);
+    } else if (arg == "--metrics") {
+      res.metrics = true;
+    } else if (arg == "--access-log") {
+      res.access_log = value_of(i);
+    } else if (arg == "--log-format") {
+      auto format = value_of(i);
+      if (format == "common")
+        res.log_format = http::access_log::format::common;
+      else if (format == "combined")
+        res.log_format = http::access_log::format::combined;
+      else {
+        std::cerr << "Unknown log format: " << format << '\n';
+        throw std::invalid_argument("Unknown log format");
+      }
+    } else if (arg == "--trace") {
+      int spans = std::stoi(std::string(value_of(i)));
+      if (spans < 0) {
+        std::cerr << "--trace must not be negative\n";
+        throw std::invalid_argument("Invalid trace size");
+      }
+
+      res.trace_spans = spans;
+    } else if (arg == "--stats") {
+      res.print_stats = true;
+      if (i + 1 < argc && !std::string_view(argv[i + 1]).starts_with("--"))
+        res.stats_interval = std::chrono::milliseconds(std::stoi(argv[++i]));
     } else {
       std::cerr << "Unknown option: " << argv[i] << '\n';
       throw std::invalid_argument("Unknown option");
@@ -63,27 +195,69 @@ input_data io::parse_input(int argc, char *argv[]) {
   return res;
 }
 
-coro::eager_task<>
+coro::eager_task<std::error_code>
 io::send_all(coro::io_engine &engine, const utils::handle &sock, std::span<const std::byte> data) {
   while (!data.empty()) {
-    co_await engine.poll(sock, POLLOUT);
-
-    ssize_t bytes_sent = send(sock, data.data(), data.size(), 0);
-    if (bytes_sent < 0) {
-      if (errno == EINTR)
-        continue;
-      
-      utils::throw_sys_error("send");
-    }
-    data = data.subspan(bytes_sent);
+    auto sent = co_await engine.try_async_send(sock, data);
+    if (!sent)
+      co_return sent.error();
+
+    data = data.subspan(*sent);
   }
+
+  co_return std::error_code();
 }
 
-coro::eager_task<>
+coro::eager_task<std::error_code>
 io::send_all(coro::io_engine &engine, const utils::handle &sock, std::string_view data) {
   return send_all(engine, sock, std::as_bytes(std::span(data.data(), data.size())));
 }
 
+coro::eager_task<std::error_code>
+io::send_all(coro::io_engine &engine, const utils::handle &sock, std::span<iovec> buffers, int flags) {
+  while (!buffers.empty()) {
+    msghdr msg{};
+    msg.msg_iov = buffers.data();
+    msg.msg_iovlen = std::min<std::size_t>(buffers.size(), IOV_MAX);
+
+    auto sent = co_await engine.try_async_sendmsg(sock, msg, flags);
+    if (!sent)
+      co_return sent.error();
+
+    // drop the buffers that were sent, the last one may be partial
+    std::size_t left = *sent;
+    while (!buffers.empty() && left >= buffers.front().iov_len) {
+      left -= buffers.front().iov_len;
+      buffers = buffers.subspan(1);
+    }
+
+    if (left > 0) {
+      buffers.front().iov_base = static_cast<char *>(buffers.front().iov_base) + left;
+      buffers.front().iov_len -= left;
+    }
+  }
+
+  co_return std::error_code();
+}
+
+coro::eager_task<std::error_code>
+io::send_file(coro::io_engine &engine, const utils::handle &sock, int file, off_t offset, std::size_t count) {
+  while (count > 0) {
+    auto sent = co_await engine.try_async_sendfile(sock, file, offset, count);
+    if (!sent)
+      co_return sent.error();
+
+    // file got truncated
+    if (*sent == 0)
+      co_return std::make_error_code(std::errc::io_error);
+
+    offset += *sent;
+    count -= *sent;
+  }
+
+  co_return std::error_code();
+}
+
 coro::task io::quote_generator(coro::io_engine &engine, std::chrono::milliseconds interval) {
   auto quotes = std::array{
     "Programming is not about typing code, it's about thinking in algorithms.",
@@ -1,11 +1,16 @@
 #pragma once
 
+#include "access_log.hpp"
 #include "io_engine.hpp"
 #include "utils.hpp"
 
+#include <sys/socket.h>
+#include <sys/uio.h>
+
 #include <cstdint>
 #include <filesystem>
 #include <fstream>
+#include <system_error>
 #include <utility>
 #include <vector>
 
@@ -13,15 +18,42 @@ namespace io {
 struct input_data {
   std::uint16_t port;
   std::filesystem::path directory;
-  bool debug_mode;
-  bool inspirational_quotes;
+  bool debug_mode = false;
+  bool inspirational_quotes = false;
   std::chrono::milliseconds quote_interval;
+  coro::io_engine::backend backend = coro::io_engine::backend::io_uring;
+  unsigned threads = 1;
+  unsigned workers = 0;
+  bool print_stats = false;
+  std::chrono::milliseconds stats_interval;
+  std::size_t cache_size = 32 << 20; // bytes (0 disables the cache)
+  std::size_t open_files = 256;      // cached file descriptors
+  std::size_t gzip_cache_size = 0;   // bytes (0: no on-the-fly gzip)
+  std::size_t max_header_size = 8192; // bigger request heads get 431
+  std::chrono::seconds header_timeout{5}; // to receive a whole request head
+  std::chrono::seconds idle_timeout{15};  // between keep-alive requests
+  int backlog = SOMAXCONN;                // of the listening sockets
+  std::size_t max_connections = 10000;    // in flight on all threads
+  std::chrono::milliseconds shed_lag{100}; // 503 above this loop lag (0: never)
+  std::size_t trace_spans = 0;             // per loop (0: no tracing)
+  bool metrics = false;                    // serve GET /__metrics
+  std::filesystem::path access_log;        // "-" for stdout (empty: no log)
+  http::access_log::format log_format = http::access_log::format::combined;
 };
 
 input_data parse_input(int argc, char *argv[]);
 
-coro::eager_task<> send_all(coro::io_engine &engine, const utils::handle &sock, std::span<const std::byte> data);
-coro::eager_task<> send_all(coro::io_engine &engine, const utils::handle &sock, std::string_view data);
+// returns the error that stopped the transfer (if any)
+coro::eager_task<std::error_code> send_all(coro::io_engine &engine, const utils::handle &sock, std::span<const std::byte> data);
+coro::eager_task<std::error_code> send_all(coro::io_engine &engine, const utils::handle &sock, std::string_view data);
+
+// gathers the buffers into as few sendmsg calls as possible (the iovecs are
+//  advanced over what was sent), MSG_MORE in flags holds back a partial
+//  segment for the data that follows (a sendfile)
+coro::eager_task<std::error_code> send_all(coro::io_engine &engine, const utils::handle &sock, std::span<iovec> buffers, int flags = 0);
+
+// send count bytes of file (starting at offset) with sendfile
+coro::eager_task<std::error_code> send_file(coro::io_engine &engine, const utils::handle &sock, int file, off_t offset, std::size_t count);
 
 coro::task quote_generator(coro::io_engine &engine, std::chrono::milliseconds interval);
 } // namespace io
\ No newline at end of file
@@ -1,64 +1,489 @@
 #include "io_engine.hpp"
+#include "uring.hpp"
 
 #include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 #include <algorithm>
+#include <array>
 #include <cassert>
 #include <exception>
 #include <stdexcept>
+#include <system_error>
 #include <vector>
 
 using namespace coro;
 
+// user_data of the io_uring poll on wake_fd (0 is used for cancellations)
+static constexpr std::uint64_t wake_tag = 1;
+
+// epoll event bits have the same values as their poll counterparts on linux
+static_assert(EPOLLIN == POLLIN && EPOLLOUT == POLLOUT &&
+              EPOLLPRI == POLLPRI && EPOLLERR == POLLERR &&
+              EPOLLHUP == POLLHUP && EPOLLRDHUP == POLLRDHUP);
+
+std::string_view coro::to_string(io_engine::backend type) {
+  switch (type) {
+  case io_engine::backend::poll:
+    return "poll";
+  case io_engine::backend::epoll:
+    return "epoll";
+  case io_engine::backend::io_uring:
+    return "io_uring";
+  }
+
+  return "unknown";
+}
+
+io_engine::backend coro::backend_from_string(std::string_view name) {
+  if (name == "poll")
+    return io_engine::backend::poll;
+  if (name == "epoll")
+    return io_engine::backend::epoll;
+  if (name == "io_uring" || name == "uring")
+    return io_engine::backend::io_uring;
+
+  throw std::invalid_argument("Unknown io_engine backend");
+}
+
+io_engine::io_engine(backend type) : type(type) {
+  wake_fd = utils::handle(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+  if (!wake_fd)
+    utils::throw_sys_error("eventfd");
+
+  if (type == backend::io_uring) {
+    try {
+      ring = std::make_unique<uring>(4096);
+
+      // other operations fall back to POLL_ADD + syscall
+      if (!ring->supports(IORING_OP_POLL_ADD) ||
+          !ring->supports(IORING_OP_ASYNC_CANCEL))
+        throw std::system_error(ENOSYS, std::system_category(),
+                                "io_uring: missing POLL_ADD/ASYNC_CANCEL");
+    } catch (const std::system_error &e) {
+      if (utils::debug_mode)
+        std::cout << "io_uring unavailable (" << e.what()
+                  << "), falling back to epoll\n";
+
+      ring.reset();
+      this->type = type = backend::epoll;
+    }
+  }
+
+  if (type == backend::epoll) {
+    epoll_fd = utils::handle(epoll_create1(EPOLL_CLOEXEC));
+    if (!epoll_fd)
+      utils::throw_sys_error("epoll_create1");
+
+    // level triggered and never disarmed
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = wake_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev) == -1)
+      utils::throw_sys_error("epoll_ctl");
+  }
+
+  if (type == backend::io_uring) {
+    uring_watch_wakeup();
+  }
+}
+
+void io_engine::post(std::coroutine_handle<> handle) {
+  bool was_empty;
+
+  {
+    std::lock_guard lock(posted_mutex);
+    was_empty = posted.empty();
+    posted.push_back(handle);
+  }
+
+  // the engine drains the whole list, so it only has to be woken up once
+  if (was_empty) {
+    std::uint64_t one = 1;
+    while (write(wake_fd, &one, sizeof(one)) == -1 && errno == EINTR)
+      ;
+  }
+}
+
+void io_engine::clear_wakeup() {
+  std::uint64_t value;
+  while (read(wake_fd, &value, sizeof(value)) == -1 && errno == EINTR)
+    ;
+}
+
+void io_engine::queue_posted() {
+  std::vector<std::coroutine_handle<>> handles;
+
+  {
+    std::lock_guard lock(posted_mutex);
+    if (posted.empty())
+      return;
+    handles.swap(posted);
+  }
+
+  // coroutines coming back from other threads continue client work
+  auto now = std::chrono::steady_clock::now();
+  for (auto handle : handles)
+    run_queue[static_cast<std::size_t>(priority::io)].push_back({handle, now});
+
+  queued += handles.size();
+}
+
+io_engine::priority io_engine::priority_of(const operation *op) {
+  if (op->kind == op_kind::accept)
+    return priority::accept;
+  if (op->fd == -1)
+    return priority::timer;
+  return priority::io;
+}
+
+void io_engine::make_ready(std::span<operation *const> ops) {
+  if (ops.empty())
+    return;
+
+  auto now = std::chrono::steady_clock::now();
+  for (auto *op : ops)
+    run_queue[static_cast<std::size_t>(priority_of(op))].push_back(
+        {op->handle, now});
+
+  queued += ops.size();
+}
+
+void io_engine::run_ready() {
+  if (queued == 0)
+    return;
+
+  std::size_t budget = run_budget;
+  auto oldest = std::chrono::steady_clock::time_point::max();
+
+  for (auto &queue : run_queue) {
+    while (budget != 0 && !queue.empty()) {
+      auto entry = queue.front();
+      queue.pop_front();
+      --queued;
+      --budget;
+
+      oldest = std::min(oldest, entry.since);
+      entry.handle.resume();
+    }
+  }
+
+  auto relaxed_max = [](std::atomic<std::int64_t> &to, std::int64_t value) {
+    if (value > to.load(std::memory_order_relaxed))
+      to.store(value, std::memory_order_relaxed);
+  };
+
+  std::int64_t lag = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         std::chrono::steady_clock::now() - oldest)
+                         .count();
+  std::int64_t average = lag_ns.load(std::memory_order_relaxed);
+  lag_ns.store(average + (lag - average) / 8, std::memory_order_relaxed);
+  relaxed_max(max_lag_ns, lag);
+
+  queue_depth.store(queued, std::memory_order_relaxed);
+  if (queued > peak_queue_depth.load(std::memory_order_relaxed))
+    peak_queue_depth.store(queued, std::memory_order_relaxed);
+}
+
 io_engine::~io_engine() {
   std::exception_ptr eptr =
       std::make_exception_ptr(std::runtime_error("io_engine destroyed"));
 
-  while (!operations.empty()) {
-    auto *op = operations.back();
-    operations.pop_back();
+  // operations that already completed get their results
+  while (queued != 0)
+    run_ready();
+
+  // the kernel may still write into buffers of in-flight operations, so
+  //  cancel all of them and wait until they complete before resuming
+  //  (one cancellation each, IORING_ASYNC_CANCEL_ANY needs Linux 5.19)
+  if (ring && !submitted.empty()) {
+    for (auto *op : submitted)
+      uring_cancel(op);
+
+    while (!submitted.empty()) {
+      if (ring->submit_and_wait(1) == -1 && errno != EINTR)
+        break;
+
+      ring->for_each_cqe([&](const io_uring_cqe &cqe) {
+        if (cqe.user_data == wake_tag)
+          return;
+
+        if (auto *op = reinterpret_cast<operation *>(cqe.user_data)) {
+          uring_untrack(op);
+          if (!timers.contains(op))
+            operations.push_back(op);
+        }
+      });
+    }
+  }
+
+  auto ops = all_operations();
+  for (auto *op : ops)
+    timers.erase(op);
+  operations.clear();
+  registrations.clear();
+
+  for (auto *op : ops) {
     op->exception = eptr;
     op->handle.resume();
   }
 }
 
-void io_engine::do_pull(std::function<int(std::span<pollfd>)> poll_fn) {
-  if (utils::debug_mode) {
-    std::cout << "Pending operations: " << operations.size() << "\n";
-    bool first = true;
+void io_engine::set_poll_error(operation *op) {
+  if (op->revents & POLLERR)
+    op->error = poll_errc::pollerr;
+  else if (op->revents & POLLHUP)
+    op->error = poll_errc::pollhup;
+  else if (op->revents & POLLNVAL)
+    op->error = poll_errc::pollnval;
+}
 
-    for (auto *op : operations) {
-      if (first) {
-        std::cout << "/--------------------------------\n";
-        first = false;
-      } else {
-        std::cout << "|--------------------------------\n";
-      }
+bool io_engine::try_perform(operation *op) {
+  atomic_counters *counters = nullptr;
+
+  switch (op->kind) {
+  case op_kind::recv:
+    counters = &fast_recv;
+    break;
+  case op_kind::send:
+  case op_kind::sendmsg:
+  case op_kind::sendfile:
+    counters = &fast_send;
+    break;
+  case op_kind::accept:
+    counters = &fast_accept;
+    break;
+  case op_kind::poll:
+  case op_kind::read:
+    // a pread of a regular file never reports EAGAIN, io_uring should do it
+    return false;
+  }
 
-      if (op->fd != -1) {
-        std::cout << "| Fd: " << op->fd << "\n";
-        std::cout << "| events: " << op->events << "\n";
-      }
-      if (op->timeout !=
-          std::chrono::time_point<std::chrono::steady_clock>::max())
-        std::cout << "| timeout: "
-                  << std::chrono::duration_cast<std::chrono::milliseconds>(
-                         op->timeout - std::chrono::steady_clock::now())
-                         .count()
-                  << "ms\n";
+  bool done = perform(op);
+  counters->count(done);
+  return done;
+}
+
+void io_engine::atomic_counters::count(bool hit) {
+  calls.store(calls.load(std::memory_order_relaxed) + 1,
+              std::memory_order_relaxed);
+  if (hit)
+    hits.store(hits.load(std::memory_order_relaxed) + 1,
+               std::memory_order_relaxed);
+}
+
+io_engine::fast_path_counters io_engine::atomic_counters::load() const {
+  return {.calls = calls.load(std::memory_order_relaxed),
+          .hits = hits.load(std::memory_order_relaxed)};
+}
+
+io_engine::statistics io_engine::stats() const {
+  return {.recv = fast_recv.load(),
+          .send = fast_send.load(),
+          .accept = fast_accept.load(),
+          .run_queue_depth = queue_depth.load(std::memory_order_relaxed),
+          .peak_run_queue_depth =
+              peak_queue_depth.load(std::memory_order_relaxed),
+          .loop_lag = loop_lag(),
+          .max_loop_lag = std::chrono::nanoseconds(
+              max_lag_ns.load(std::memory_order_relaxed)),
+          .pending_operations = pending_count.load(std::memory_order_relaxed),
+          .iterations = iteration_count.load(std::memory_order_relaxed),
+          .poll_time = std::chrono::nanoseconds(
+              poll_ns.load(std::memory_order_relaxed))};
+}
+
+bool io_engine::perform(operation *op) {
+  ssize_t ret = -1;
+
+  switch (op->kind) {
+  case op_kind::poll:
+    return true;
+  case op_kind::recv:
+    ret = ::recv(op->fd, op->buffer, op->length, MSG_DONTWAIT);
+    break;
+  case op_kind::send:
+    ret = ::send(op->fd, op->buffer, op->length, MSG_DONTWAIT | MSG_NOSIGNAL);
+    break;
+  case op_kind::sendmsg:
+    ret = ::sendmsg(op->fd, reinterpret_cast<const msghdr *>(op->buffer),
+                    MSG_DONTWAIT | MSG_NOSIGNAL | op->flags);
+    break;
+  case op_kind::accept:
+    ret = ::accept4(op->fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    break;
+  case op_kind::read:
+    ret = ::pread(op->fd, op->buffer, op->length, op->offset);
+    break;
+  case op_kind::sendfile: {
+    off_t offset = op->offset;
+    ret = ::sendfile(op->fd, op->source, &offset, op->length);
+    break;
+  }
+  }
+
+  if (ret == -1) {
+    // spurious readiness, wait for the fd again
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return false;
+
+    op->error = std::error_code(errno, std::system_category());
+    return true;
+  }
+
+  op->result = ret;
+  return true;
+}
+
+bool io_engine::has_timer(const operation *op) {
+  return op->fd == -1 ||
+         op->timeout != std::chrono::steady_clock::time_point::max();
+}
+
+auto io_engine::all_operations() const -> std::vector<operation *> {
+  // poll backend keeps all of them, io_uring also keeps submitted operations
+  //  here while the engine is being destroyed
+  std::vector<operation *> ops = operations;
+
+  if (type != backend::poll) {
+    ops.insert(ops.end(), timers.begin(), timers.end());
+
+    for (auto &[fd, reg] : registrations)
+      for (auto *op : reg.waiters)
+        if (!timers.contains(op))
+          ops.push_back(op);
+  }
+
+  return ops;
+}
+
+void io_engine::dump_operations() const {
+  auto ops = all_operations();
+
+  std::cout << "Pending operations: " << ops.size() << "\n";
+  bool first = true;
+
+  for (auto *op : ops) {
+    if (first) {
+      std::cout << "/--------------------------------\n";
+      first = false;
+    } else {
+      std::cout << "|--------------------------------\n";
+    }
+
+    if (op->fd != -1) {
+      std::cout << "| Fd: " << op->fd << "\n";
+      std::cout << "| events: " << op->events << "\n";
+    }
+    if (op->timeout !=
+        std::chrono::time_point<std::chrono::steady_clock>::max())
+      std::cout << "| timeout: "
+                << std::chrono::duration_cast<std::chrono::milliseconds>(
+                       op->timeout - std::chrono::steady_clock::now())
+                       .count()
+                << "ms\n";
+  }
+
+  if (!first)
+    std::cout << "\\--------------------------------\n";
+
+  if (!submitted.empty())
+    std::cout << "In flight (io_uring): " << submitted.size() << "\n";
+
+  std::cout << "\n";
+}
+
+void io_engine::do_pull(bool wait) {
+  if (utils::debug_mode)
+    dump_operations();
+
+  // coroutines left over from the last budget only let us look for new
+  //  events (so that they are not starved by a blocking wait)
+  if (queued != 0)
+    wait = false;
+
+  // nothing waits while the loop is idle, so the lag of the last burst
+  //  fades with every wait (overload checks would keep seeing it otherwise)
+  if (wait)
+    lag_ns.store(lag_ns.load(std::memory_order_relaxed) / 2,
+                 std::memory_order_relaxed);
+
+  auto poll_start = std::chrono::steady_clock::now();
+
+  switch (type) {
+  case backend::poll:
+    poll_pull(wait);
+    break;
+  case backend::epoll:
+    epoll_pull(wait);
+    break;
+  case backend::io_uring:
+    uring_pull(wait);
+    break;
+  }
+
+  std::int64_t polled = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - poll_start)
+                            .count();
+  poll_ns.store(poll_ns.load(std::memory_order_relaxed) + polled,
+                std::memory_order_relaxed);
+  iteration_count.store(iteration_count.load(std::memory_order_relaxed) + 1,
+                        std::memory_order_relaxed);
+
+  queue_posted();
+  run_ready();
+
+  pending_count.store(pending, std::memory_order_relaxed);
+}
+
+int io_engine::poll_wait(std::span<pollfd> fds, bool wait) const {
+  if (!wait) {
+    while (true) {
+      // non-blocking poll
+      int ret = ::poll(fds.data(), fds.size(), 0);
+
+      if (ret == -1 && errno == EINTR)
+        continue;
+
+      return ret;
     }
+  }
 
-    if (!first)
-      std::cout << "\\--------------------------------\n";
+  auto min_timeout = timers.earliest();
 
-    std::cout << "\n";
+  while (true) {
+    auto now = std::chrono::steady_clock::now();
+    auto timeout =
+        std::chrono::duration_cast<std::chrono::milliseconds>(min_timeout - now);
+    if (timeout.count() < 0)
+      return 0;
+
+    if (min_timeout == std::chrono::steady_clock::time_point::max())
+      timeout = std::chrono::milliseconds(-1);
+
+    int ret = ::poll(fds.data(), fds.size(), timeout.count());
+    if (ret == -1) {
+      if (errno == EINTR)
+        continue;
+
+      return ret;
+    }
+
+    if (ret > 0)
+      return ret;
   }
+}
 
+void io_engine::poll_pull(bool wait) {
   int ret;
 
   {
     std::vector<pollfd> fds;
-    fds.reserve(operations.size());
+    fds.reserve(operations.size() + 1);
 
     for (auto *op : operations) {
       pollfd pfd;
@@ -68,10 +493,17 @@ void io_engine::do_pull(std::function<int(std::span<pollfd>)> poll_fn) {
       fds.push_back(pfd);
     }
 
-    ret = poll_fn(fds);
+    fds.push_back({wake_fd, POLLIN, 0});
+
+    ret = poll_wait(fds, wait);
 
-    for (size_t i = 0; i < fds.size(); ++i)
+    for (size_t i = 0; i < operations.size(); ++i)
       operations[i]->revents = fds[i].revents;
+
+    if (fds.back().revents & POLLIN) {
+      clear_wakeup();
+      --ret;
+    }
   }
 
   std::vector<operation *> to_resume;
@@ -79,7 +511,7 @@ void io_engine::do_pull(std::function<int(std::span<pollfd>)> poll_fn) {
   auto now = std::chrono::steady_clock::now();
 
   if (ret == -1) {
-    std::exception_ptr eptr = utils::make_sys_error("poll");
+    std::error_code error(errno, std::system_category());
 
     // throw error on all waiting tasks (only those that use file descriptors)
     // for timeout tasks, add them too
@@ -91,82 +523,492 @@ void io_engine::do_pull(std::function<int(std::span<pollfd>)> poll_fn) {
     std::ranges::copy_if(operations, std::back_inserter(to_resume), to_remove_pred);
     std::erase_if(operations, to_remove_pred);
 
-    for (auto *op : to_resume)
+    for (auto *op : to_resume) {
+      timers.erase(op);
       if (op->fd != -1)
-        op->exception = eptr;
-    
+        op->error = error;
+    }
+
   } else {
     // add all events that happened
 
-    auto to_remove_pred = [&](operation *op) {
-      return (op->fd != -1 && op->revents & (POLLERR | POLLHUP | POLLNVAL | op->events)) || (now >= op->timeout);
-    };
+    std::erase_if(operations, [&](operation *op) {
+      bool ready = op->fd != -1 &&
+                   op->revents & (POLLERR | POLLHUP | POLLNVAL | op->events) &&
+                   perform(op);
 
-    std::ranges::copy_if(operations, std::back_inserter(to_resume), to_remove_pred);
-    std::erase_if(operations, to_remove_pred);
+      if (!ready && now < op->timeout)
+        return false;
 
-    for (auto *op : to_resume) {
-      if (op->fd != -1) {
-        if (op->revents & POLLERR)
-          op->exception = std::make_exception_ptr(pollerr_error());
-        else if (op->revents & POLLHUP)
-          op->exception = std::make_exception_ptr(pollhup_error());
-        else if (op->revents & POLLNVAL)
-          op->exception = std::make_exception_ptr(pollnval_error());
+      if (!ready && op->kind != op_kind::poll)
+        op->timed_out = true;
+
+      timers.erase(op);
+      to_resume.push_back(op);
+      return true;
+    });
+
+    for (auto *op : to_resume)
+      if (op->fd != -1 && op->kind == op_kind::poll)
+        set_poll_error(op);
+  }
+
+  pending -= to_resume.size();
+  make_ready(to_resume);
+}
+
+std::error_code io_engine::epoll_arm(int fd, registration &reg) {
+  std::uint32_t events = 0;
+  for (auto *op : reg.waiters)
+    events |= op->events;
+
+  if (events == reg.armed)
+    return {};
+
+  // oneshot, so that a ready fd without waiters does not wake us up again
+  //  (it stays in the epoll set and is only re-armed on the next await)
+  epoll_event ev{};
+  ev.events = events | EPOLLONESHOT;
+  ev.data.fd = fd;
+
+  int ret = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+  if (ret == -1 && errno == ENOENT)
+    ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+
+  if (ret == -1)
+    return std::error_code(errno, std::system_category());
+
+  reg.armed = events;
+  return {};
+}
+
+void io_engine::epoll_add(operation *op) {
+  auto [it, inserted] = registrations.try_emplace(op->fd);
+  auto &reg = it->second;
+  reg.waiters.push_back(op);
+
+  auto error = epoll_arm(op->fd, reg);
+  if (!error)
+    return;
+
+  reg.waiters.pop_back();
+  if (reg.waiters.empty())
+    registrations.erase(it);
+
+  if (error == std::errc::operation_not_permitted) {
+    // regular files cannot be added to the epoll set (and poll reports
+    //  them as always ready)
+    op->revents = op->events;
+  } else if (error == std::errc::bad_file_descriptor) {
+    op->revents = POLLNVAL;
+  } else {
+    op->error = error;
+  }
+
+  // report the result on the next pull
+  timers.erase(op);
+  op->timeout = {};
+  timers.push(op);
+}
+
+void io_engine::epoll_pull(bool wait) {
+  std::array<epoll_event, 256> events;
+  int ret;
+
+  while (true) {
+    int timeout_ms = 0;
+
+    if (wait) {
+      auto min_timeout = timers.earliest();
+      if (min_timeout == std::chrono::steady_clock::time_point::max()) {
+        timeout_ms = -1;
+      } else {
+        auto timeout = std::chrono::ceil<std::chrono::milliseconds>(
+            min_timeout - std::chrono::steady_clock::now());
+        timeout_ms = std::max<int>(timeout.count(), 0);
       }
     }
+
+    ret = epoll_wait(epoll_fd, events.data(), events.size(), timeout_ms);
+    if (ret == -1 && errno == EINTR)
+      continue;
+
+    break;
   }
 
-  for (auto *op : to_resume)
-    op->handle.resume();
-}
+  std::vector<operation *> to_resume;
 
-void io_engine::pull() {
-  do_pull([](std::span<pollfd> fds) {
-    while (true) {
-      // non-blocking poll
-      int ret = ::poll(fds.data(), fds.size(), 0);
+  auto complete = [&](operation *op) {
+    to_resume.push_back(op);
+    timers.erase(op);
+  };
 
-      if (ret == -1 && errno == EINTR)
-        continue;
+  if (ret == -1) {
+    std::error_code error(errno, std::system_category());
 
-      return ret;
+    // fail all waiting tasks that use file descriptors
+    for (auto &[fd, reg] : registrations) {
+      for (auto *op : reg.waiters) {
+        op->error = error;
+        complete(op);
+      }
     }
-  });
-}
 
-void io_engine::pull_all() {
-  while (!operations.empty()) {
-    do_pull([&](std::span<pollfd> fds) {
-      auto min_timeout = std::chrono::steady_clock::time_point::max();
-
-      for (auto *op : operations)
-        if (op->timeout < min_timeout)
-          min_timeout = op->timeout;
-
-      while (true) {
-        auto now = std::chrono::steady_clock::now();
-        auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
-            min_timeout - now);
-        if (timeout.count() < 0)
-          return 0;
-
-        int ret = ::poll(fds.data(), fds.size(), timeout.count());
-        if (ret == -1) {
-          if (errno == EINTR)
-            continue;
-
-          return ret;
+    registrations.clear();
+  }
+
+  for (int i = 0; i < ret; ++i) {
+    int fd = events[i].data.fd;
+    auto revents = static_cast<short>(events[i].events);
+
+    if (fd == wake_fd) {
+      clear_wakeup();
+      continue;
+    }
+
+    auto it = registrations.find(fd);
+    if (it == registrations.end())
+      continue; // all waiters have timed out
+
+    auto &reg = it->second;
+    reg.armed = 0;
+
+    std::erase_if(reg.waiters, [&](operation *op) {
+      if (!(revents & (POLLERR | POLLHUP | op->events)))
+        return false;
+
+      op->revents = revents;
+      if (op->kind == op_kind::poll)
+        set_poll_error(op);
+      else if (!perform(op))
+        return false;
+
+      complete(op);
+      return true;
+    });
+
+    if (reg.waiters.empty()) {
+      registrations.erase(it);
+    } else if (auto error = epoll_arm(fd, reg)) {
+      for (auto *op : reg.waiters) {
+        op->error = error;
+        complete(op);
+      }
+      registrations.erase(it);
+    }
+  }
+
+  // expire timeouts
+  auto now = std::chrono::steady_clock::now();
+
+  while (!timers.empty() && now >= timers.earliest()) {
+    auto *op = timers.pop();
+
+    if (op->fd != -1) {
+      if (auto it = registrations.find(op->fd); it != registrations.end()) {
+        std::erase(it->second.waiters, op);
+        if (it->second.waiters.empty())
+          registrations.erase(it); // the fd may stay armed, events are ignored
+      }
+
+      if (op->kind != op_kind::poll) {
+        // ready (or invalid) fds that could not be added to the epoll set
+        if (op->error || !op->revents || !perform(op))
+          op->timed_out = !op->error;
+      } else {
+        // poll_once reports current flags of the fd
+        if (op->events == 0 && !op->error) {
+          pollfd pfd{op->fd, 0, 0};
+          if (::poll(&pfd, 1, 0) == 1)
+            op->revents = pfd.revents;
         }
 
-        if (ret > 0)
-          return ret;
+        if (!op->error)
+          set_poll_error(op);
       }
-    });
+    }
+
+    to_resume.push_back(op);
   }
+
+  pending -= to_resume.size();
+  make_ready(to_resume);
+}
+
+bool io_engine::uring_submitted(const operation *op) const {
+  // poll_once is answered on the next pull without the kernel
+  return op->fd != -1 && (op->kind != op_kind::poll || op->events != 0);
+}
+
+void io_engine::uring_submit(operation *op) {
+  std::uint8_t opcode = IORING_OP_NOP;
+  switch (op->kind) {
+  case op_kind::poll:
+    opcode = IORING_OP_POLL_ADD;
+    break;
+  case op_kind::recv:
+    opcode = IORING_OP_RECV;
+    break;
+  case op_kind::send:
+    opcode = IORING_OP_SEND;
+    break;
+  case op_kind::sendmsg:
+    opcode = IORING_OP_SENDMSG;
+    break;
+  case op_kind::accept:
+    opcode = IORING_OP_ACCEPT;
+    break;
+  case op_kind::read:
+    opcode = IORING_OP_READ;
+    break;
+  case op_kind::sendfile:
+    // there is no sendfile opcode
+    opcode = IORING_OP_LAST;
+    break;
+  }
+
+  // operations the kernel does not know (or that would block on an
+  //  O_NONBLOCK fd on older kernels) wait for readiness first
+  if (opcode == IORING_OP_LAST || !ring->supports(opcode) || op->polling) {
+    op->polling = op->kind != op_kind::poll;
+    opcode = IORING_OP_POLL_ADD;
+  }
+
+  io_uring_sqe *sqe = ring->get_sqe();
+  sqe->opcode = opcode;
+  sqe->fd = op->fd;
+  sqe->user_data = reinterpret_cast<std::uint64_t>(op);
+
+  switch (opcode) {
+  case IORING_OP_POLL_ADD:
+    sqe->poll32_events = static_cast<std::uint16_t>(op->events);
+    break;
+  case IORING_OP_RECV:
+    sqe->addr = reinterpret_cast<std::uint64_t>(op->buffer);
+    sqe->len = op->length;
+    break;
+  case IORING_OP_SEND:
+    sqe->addr = reinterpret_cast<std::uint64_t>(op->buffer);
+    sqe->len = op->length;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    break;
+  case IORING_OP_SENDMSG:
+    sqe->addr = reinterpret_cast<std::uint64_t>(op->buffer);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | op->flags;
+    break;
+  case IORING_OP_ACCEPT:
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    break;
+  case IORING_OP_READ:
+    sqe->addr = reinterpret_cast<std::uint64_t>(op->buffer);
+    sqe->len = op->length;
+    sqe->off = op->offset;
+    break;
+  }
+
+  uring_track(op);
+}
+
+void io_engine::uring_track(operation *op) {
+  op->submitted_index = submitted.size();
+  submitted.push_back(op);
+}
+
+void io_engine::uring_untrack(operation *op) {
+  // the last one takes its place
+  auto *last = submitted.back();
+  submitted[op->submitted_index] = last;
+  last->submitted_index = op->submitted_index;
+  submitted.pop_back();
+  op->submitted_index = not_queued;
+}
+
+void io_engine::uring_watch_wakeup() {
+  io_uring_sqe *sqe = ring->get_sqe();
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = wake_fd;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = wake_tag;
+}
+
+void io_engine::uring_cancel(operation *op) {
+  io_uring_sqe *sqe = ring->get_sqe();
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = reinterpret_cast<std::uint64_t>(op);
+  sqe->user_data = 0; // result of the cancellation itself is not interesting
+}
+
+void io_engine::uring_pull(bool wait) {
+  unsigned wait_nr = 0;
+  __kernel_timespec ts{};
+  const __kernel_timespec *timeout = nullptr;
+
+  if (wait) {
+    wait_nr = 1;
+
+    auto min_timeout = timers.earliest();
+    if (min_timeout != std::chrono::steady_clock::time_point::max()) {
+      auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+          min_timeout - std::chrono::steady_clock::now());
+      ns = std::max(ns, std::chrono::nanoseconds::zero());
+
+      ts.tv_sec = ns.count() / 1'000'000'000;
+      ts.tv_nsec = ns.count() % 1'000'000'000;
+      timeout = &ts;
+    }
+  }
+
+  if (ring->submit_and_wait(wait_nr, timeout) == -1 && errno != EINTR &&
+      errno != ETIME && errno != EBUSY)
+    utils::throw_sys_error("io_uring_enter");
+
+  std::vector<operation *> to_resume;
+
+  ring->for_each_cqe([&](const io_uring_cqe &cqe) {
+    if (cqe.user_data == wake_tag) {
+      clear_wakeup();
+      uring_watch_wakeup();
+      return;
+    }
+
+    auto *op = reinterpret_cast<operation *>(cqe.user_data);
+    if (!op)
+      return;
+
+    uring_untrack(op);
+
+    // the cancellation of an expired operation may have come too late for
+    //  this entry, a retry would have neither a timer nor a cancellation
+    //  left, so the operation ends as timed out instead
+    bool expired = false;
+    auto retry = [&] {
+      if (op->timed_out) {
+        expired = true;
+        return false;
+      }
+
+      uring_submit(op);
+      return true;
+    };
+
+    if (cqe.res == -ECANCELED && op->timed_out) {
+      // nothing happened before the timeout
+    } else if (op->polling && cqe.res >= 0) {
+      // fd is ready, do the syscall ourselves
+      if (!perform(op)) {
+        if (retry())
+          return;
+      } else {
+        op->polling = false;
+      }
+    } else if (cqe.res == -EAGAIN && op->kind != op_kind::poll) {
+      op->polling = true;
+      if (retry())
+        return;
+    } else if (cqe.res < 0) {
+      op->error = std::error_code(-cqe.res, std::system_category());
+    } else if (op->kind == op_kind::poll) {
+      op->revents = static_cast<short>(cqe.res);
+      set_poll_error(op);
+    } else {
+      op->result = cqe.res;
+    }
+
+    // a completion racing with the cancellation wins
+    if (op->timed_out && cqe.res != -ECANCELED && !expired)
+      op->timed_out = false;
+
+    timers.erase(op);
+    to_resume.push_back(op);
+  });
+
+  // expire timeouts (submitted operations are resumed once the kernel
+  //  confirms the cancellation)
+  auto now = std::chrono::steady_clock::now();
+
+  while (!timers.empty() && now >= timers.earliest()) {
+    auto *op = timers.pop();
+
+    if (uring_submitted(op)) {
+      op->timed_out = true;
+      uring_cancel(op);
+      continue;
+    }
+
+    // poll_once reports current flags of the fd
+    if (op->fd != -1) {
+      pollfd pfd{op->fd, 0, 0};
+      if (::poll(&pfd, 1, 0) == 1)
+        op->revents = pfd.revents;
+      set_poll_error(op);
+    }
+
+    to_resume.push_back(op);
+  }
+
+  pending -= to_resume.size();
+  make_ready(to_resume);
+}
+
+void io_engine::pull() { do_pull(false); }
+
+void io_engine::pull_all() {
+  while (pending != 0 || queued != 0 ||
+         remote_pending.load(std::memory_order_acquire) != 0)
+    do_pull(true);
 }
 
 void io_engine::add_operation(operation *op) {
   assert(op->handle);
-  operations.push_back(op);
-}
\ No newline at end of file
+  ++pending;
+
+  if (has_timer(op))
+    timers.push(op);
+
+  if (type == backend::poll) {
+    operations.push_back(op);
+    return;
+  }
+
+  if (type == backend::io_uring) {
+    if (uring_submitted(op))
+      uring_submit(op);
+  } else if (op->fd != -1 && op->events != 0) {
+    epoll_add(op);
+  }
+}
+
+namespace {
+struct poll_category_impl : std::error_category {
+  const char *name() const noexcept override { return "poll"; }
+
+  std::string message(int value) const override {
+    switch (static_cast<poll_errc>(value)) {
+    case poll_errc::pollerr:
+      return "POLLERR";
+    case poll_errc::pollhup:
+      return "POLLHUP";
+    case poll_errc::pollnval:
+      return "POLLNVAL";
+    }
+    return "unknown poll error";
+  }
+};
+} // namespace
+
+const std::error_category &coro::poll_category() noexcept {
+  static poll_category_impl instance;
+  return instance;
+}
+
+void coro::throw_io_error(std::error_code error) {
+  if (error == poll_errc::pollerr)
+    throw io_engine::pollerr_error();
+  if (error == poll_errc::pollhup)
+    throw io_engine::pollhup_error();
+  if (error == poll_errc::pollnval)
+    throw io_engine::pollnval_error();
+
+  throw std::system_error(error);
+}
@@ -1,23 +1,36 @@
 #pragma once
 
+#include "frame_pool.hpp"
+#include "io_result.hpp"
+#include "timer_queue.hpp"
 #include "utils.hpp"
 
 #include <poll.h>
+#include <sys/socket.h>
 
 #include <chrono>
 #include <concepts>
 #include <coroutine>
+#include <cstdint>
+#include <atomic>
+#include <array>
+#include <deque>
 #include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <stdexcept>
-#include <functional>
-#include <vector>
 #include <span>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
 
 namespace coro {
 
 namespace detail {
   template <typename Task, typename T, typename Initial>
-  struct promise {
+  struct promise : pooled_frame {
     using handle_type = std::coroutine_handle<promise>;
     auto get_return_object() -> Task { return Task{handle_type::from_promise(*this)}; }
 
@@ -48,7 +61,7 @@ namespace detail {
   };
 
   template <typename Task, typename Initial>
-  struct promise<Task, void, Initial> {
+  struct promise<Task, void, Initial> : pooled_frame {
     using handle_type = std::coroutine_handle<promise>;
     auto get_return_object() -> Task { return Task{handle_type::from_promise(*this)}; }
 
@@ -110,7 +123,7 @@ namespace detail {
 // fire-and-forget task (as it is not awaited, we cannot return any value/exception)
 // behaves somewhat like detached std::thread (no return value/joining and exception means terminate)
 struct task {
-  struct promise_type {
+  struct promise_type : detail::pooled_frame {
     // as this is a fire-and-forget task we don't return any handle to the
     // coroutine
     auto get_return_object() -> task { return {}; }
@@ -212,7 +225,7 @@ public:
   struct promise_type;
   using handle_type = std::coroutine_handle<promise_type>;
 
-  struct promise_type {
+  struct promise_type : detail::pooled_frame {
     auto get_return_object() -> generator { return generator{handle_type::from_promise(*this)}; }
 
     std::suspend_always initial_suspend() { return {}; }
@@ -259,7 +272,7 @@ public:
   struct promise_type;
   using handle_type = std::coroutine_handle<promise_type>;
 
-  struct promise_type {
+  struct promise_type : detail::pooled_frame {
     auto get_return_object() -> async_generator { return async_generator{handle_type::from_promise(*this)}; }
 
     std::suspend_always initial_suspend() { return {}; }
@@ -355,12 +368,24 @@ private:
   detail::UniqueHandle<promise_type> handle;
 };
 
+class uring;
+
 /*
 class that supports awaiting on file descriptors (poll) with timeout
+
+available backends:
+  - poll: rebuilds the pollfd list from all pending operations on every pull
+  - epoll: fds stay registered in the epoll set across awaits and only the
+    ready ones are touched on a pull
+  - io_uring: every await is queued as a submission entry and the whole batch
+    is submitted with a single io_uring_enter per pull (falls back to epoll
+    if the kernel refuses io_uring)
 */
 class io_engine {
 public:
-  io_engine() = default;
+  enum class backend { poll, epoll, io_uring };
+
+  explicit io_engine(backend type = backend::io_uring);
   io_engine(const io_engine &) = delete;
   io_engine &operator=(const io_engine &) = delete;
   io_engine(io_engine &&) = delete;
@@ -374,6 +399,76 @@ public:
   // pull all events (wait for the list to be empty)
   void pull_all();
 
+  backend get_backend() const { return type; }
+
+  // how often an optimistic (try-first) syscall completed without waiting
+  struct fast_path_counters {
+    std::uint64_t calls = 0;
+    std::uint64_t hits = 0;
+
+    double hit_rate() const {
+      return calls == 0 ? 0.0 : static_cast<double>(hits) / calls;
+    }
+  };
+
+  struct statistics {
+    fast_path_counters recv;
+    fast_path_counters send;
+    fast_path_counters accept;
+
+    // coroutines waiting in the run queue (after the last iteration)
+    std::size_t run_queue_depth = 0;
+    std::size_t peak_run_queue_depth = 0;
+
+    // loop_lag() and the worst iteration seen so far
+    std::chrono::nanoseconds loop_lag{};
+    std::chrono::nanoseconds max_loop_lag{};
+
+    // operations waiting for the backend (after the last iteration)
+    std::size_t pending_operations = 0;
+
+    // iterations of the loop and the time they spent in the backend
+    //  (waiting for events included)
+    std::uint64_t iterations = 0;
+    std::chrono::nanoseconds poll_time{};
+  };
+
+  // safe to call from other threads
+  statistics stats() const;
+
+  // moving average of how long ready coroutines wait until the loop gets
+  //  to them (measured per iteration from the oldest resumed coroutine,
+  //  halved whenever the loop goes idle)
+  std::chrono::nanoseconds loop_lag() const {
+    return std::chrono::nanoseconds(lag_ns.load(std::memory_order_relaxed));
+  }
+
+  // resume the awaiting coroutine on the thread that pulls this engine
+  //  (can be awaited from any thread)
+  auto schedule() {
+    struct awaiter {
+      io_engine &engine;
+
+      bool await_ready() const { return false; }
+      void await_suspend(std::coroutine_handle<> handle) {
+        engine.post(handle);
+      }
+      void await_resume() {}
+    };
+
+    return awaiter{*this};
+  }
+
+  // resume a suspended coroutine on the thread that pulls this engine
+  //  (safe to call from any thread, the coroutine has to be retained if it
+  //  waits for nothing else)
+  void post(std::coroutine_handle<> handle);
+
+  // coroutines that left for another thread and will come back through
+  //  schedule() are retained, so that pull_all() keeps waiting for them
+  void retain() { remote_pending.fetch_add(1, std::memory_order_relaxed); }
+  void release() { remote_pending.fetch_sub(1, std::memory_order_release); }
+
   auto wait_until(std::chrono::time_point<std::chrono::steady_clock> timeout) {
     struct awaiter {
       io_engine &engine;
@@ -400,59 +495,242 @@ public:
     return wait_until(std::chrono::steady_clock::now() + timeout_duration);
   }
 
-  auto poll_until(const utils::handle &fd, short events,
-                  std::chrono::time_point<std::chrono::steady_clock> timeout) {
-    struct awaiter {
-      io_engine &engine;
-      operation op;
+  // the try_* versions of the awaitables below return an io_result instead
+  //  of throwing (only the destruction of the engine is still reported
+  //  as an exception)
 
+  auto try_poll_until(const utils::handle &fd, short events,
+                      std::chrono::time_point<std::chrono::steady_clock> timeout) {
+    struct awaiter : operation_awaiter {
       bool await_ready() const {
         return std::chrono::steady_clock::now() >= op.timeout;
       }
-      void await_suspend(std::coroutine_handle<> handle) {
-        op.handle = handle;
-        engine.add_operation(&op);
-      }
-      short await_resume() {
-        if (op.exception)
-          std::rethrow_exception(op.exception);
+      io_result<short> await_resume() {
+        if (auto ec = error())
+          return ec;
         return op.revents;
       }
     };
 
-    return awaiter{*this, operation{nullptr, fd, events, timeout}};
+    return awaiter{{*this, operation{nullptr, fd, events, timeout}}};
+  }
+
+  auto poll_until(const utils::handle &fd, short events,
+                  std::chrono::time_point<std::chrono::steady_clock> timeout) {
+    return throwing(try_poll_until(fd, events, timeout));
+  }
+
+  template <class Rep, class Period>
+  auto try_poll_for(const utils::handle &fd, short events,
+                    const std::chrono::duration<Rep, Period> &timeout_duration) {
+    return try_poll_until(fd, events,
+                          std::chrono::steady_clock::now() + timeout_duration);
   }
 
   template <class Rep, class Period>
   auto poll_for(const utils::handle &fd, short events,
                 const std::chrono::duration<Rep, Period> &timeout_duration) {
-    return poll_until(fd, events,
-                      std::chrono::steady_clock::now() + timeout_duration);
+    return throwing(try_poll_for(fd, events, timeout_duration));
+  }
+
+  auto try_poll(const utils::handle &fd, short events) {
+    return try_poll_until(fd, events,
+                          std::chrono::steady_clock::time_point::max());
   }
 
   auto poll(const utils::handle &fd, short events) {
-    return poll_until(fd, events, std::chrono::steady_clock::time_point::max());
+    return throwing(try_poll(fd, events));
   }
 
   // get flags and return immediately
+  auto try_poll_once(const utils::handle &fd) {
+    struct awaiter : operation_awaiter {
+      bool await_ready() const { return false; }
+      io_result<short> await_resume() {
+        if (auto ec = error())
+          return ec;
+        return op.revents;
+      }
+    };
+
+    return awaiter{{*this, operation{nullptr, fd, 0, {}}}};
+  }
+
   auto poll_once(const utils::handle &fd) {
-    struct awaiter {
-      io_engine &engine;
-      operation op;
+    return throwing(try_poll_once(fd));
+  }
 
-      bool await_ready() const { return false; }
-      void await_suspend(std::coroutine_handle<> handle) {
-        op.handle = handle;
-        engine.add_operation(&op);
+  // completion based operations: io_uring performs them in the kernel, the
+  //  readiness backends wait for the fd and then do the syscall themselves
+  //
+  // recv, send and accept first try the non-blocking syscall right away and
+  //  only register with the engine if it would block
+
+  // std::nullopt if the timeout passed before any data arrived
+  auto try_async_recv(const utils::handle &fd, std::span<std::byte> buffer,
+                      std::chrono::time_point<std::chrono::steady_clock> timeout =
+                          std::chrono::steady_clock::time_point::max()) {
+    struct awaiter : operation_awaiter {
+      io_result<std::optional<std::size_t>> await_resume() {
+        if (auto ec = error())
+          return ec;
+        if (op.timed_out)
+          return std::optional<std::size_t>();
+        return std::optional<std::size_t>(op.result);
       }
-      short await_resume() {
-        if (op.exception)
-          std::rethrow_exception(op.exception);
-        return op.revents;
+    };
+
+    return awaiter{{*this, operation{.handle = nullptr,
+                                     .fd = fd,
+                                     .events = POLLIN,
+                                     .timeout = timeout,
+                                     .kind = op_kind::recv,
+                                     .buffer = buffer.data(),
+                                     .length = buffer.size()}}};
+  }
+
+  auto async_recv(const utils::handle &fd, std::span<std::byte> buffer,
+                  std::chrono::time_point<std::chrono::steady_clock> timeout =
+                      std::chrono::steady_clock::time_point::max()) {
+    return throwing(try_async_recv(fd, buffer, timeout));
+  }
+
+  template <class Rep, class Period>
+  auto try_async_recv_for(const utils::handle &fd, std::span<std::byte> buffer,
+                          const std::chrono::duration<Rep, Period> &timeout_duration) {
+    return try_async_recv(fd, buffer,
+                          std::chrono::steady_clock::now() + timeout_duration);
+  }
+
+  template <class Rep, class Period>
+  auto async_recv_for(const utils::handle &fd, std::span<std::byte> buffer,
+                      const std::chrono::duration<Rep, Period> &timeout_duration) {
+    return throwing(try_async_recv_for(fd, buffer, timeout_duration));
+  }
+
+  // number of bytes sent (may be less than buffer size)
+  auto try_async_send(const utils::handle &fd, std::span<const std::byte> buffer) {
+    struct awaiter : operation_awaiter {
+      io_result<std::size_t> await_resume() {
+        if (auto ec = error())
+          return ec;
+        return static_cast<std::size_t>(op.result);
+      }
+    };
+
+    return awaiter{{*this, operation{.handle = nullptr,
+                                     .fd = fd,
+                                     .events = POLLOUT,
+                                     .timeout = std::chrono::steady_clock::time_point::max(),
+                                     .kind = op_kind::send,
+                                     .buffer = const_cast<std::byte *>(buffer.data()),
+                                     .length = buffer.size()}}};
+  }
+
+  auto async_send(const utils::handle &fd, std::span<const std::byte> buffer) {
+    return throwing(try_async_send(fd, buffer));
+  }
+
+  // vectored send, number of bytes sent (msg has to stay valid until the
+  //  operation completes), flags are added to MSG_NOSIGNAL (e.g. MSG_MORE)
+  auto try_async_sendmsg(const utils::handle &fd, const msghdr &msg,
+                         int flags = 0) {
+    struct awaiter : operation_awaiter {
+      io_result<std::size_t> await_resume() {
+        if (auto ec = error())
+          return ec;
+        return static_cast<std::size_t>(op.result);
+      }
+    };
+
+    return awaiter{{*this, operation{.handle = nullptr,
+                                     .fd = fd,
+                                     .events = POLLOUT,
+                                     .timeout = std::chrono::steady_clock::time_point::max(),
+                                     .kind = op_kind::sendmsg,
+                                     .buffer = reinterpret_cast<std::byte *>(
+                                         const_cast<msghdr *>(&msg)),
+                                     .flags = flags}}};
+  }
+
+  auto async_sendmsg(const utils::handle &fd, const msghdr &msg,
+                     int flags = 0) {
+    return throwing(try_async_sendmsg(fd, msg, flags));
+  }
+
+  // accepted (non-blocking) socket
+  auto try_async_accept(const utils::handle &fd) {
+    struct awaiter : operation_awaiter {
+      io_result<utils::handle> await_resume() {
+        if (auto ec = error())
+          return ec;
+        return utils::handle(static_cast<int>(op.result));
       }
     };
 
-    return awaiter{*this, operation{nullptr, fd, 0, {}}};
+    return awaiter{{*this, operation{.handle = nullptr,
+                                     .fd = fd,
+                                     .events = POLLIN,
+                                     .timeout = std::chrono::steady_clock::time_point::max(),
+                                     .kind = op_kind::accept}}};
+  }
+
+  auto async_accept(const utils::handle &fd) {
+    return throwing(try_async_accept(fd));
+  }
+
+  // read from file at given offset, number of bytes read
+  auto try_async_read(const utils::handle &fd, std::span<std::byte> buffer,
+                      off_t offset) {
+    struct awaiter : operation_awaiter {
+      io_result<std::size_t> await_resume() {
+        if (auto ec = error())
+          return ec;
+        return static_cast<std::size_t>(op.result);
+      }
+    };
+
+    return awaiter{{*this, operation{.handle = nullptr,
+                                     .fd = fd,
+                                     .events = POLLIN,
+                                     .timeout = std::chrono::steady_clock::time_point::max(),
+                                     .kind = op_kind::read,
+                                     .buffer = buffer.data(),
+                                     .length = buffer.size(),
+                                     .offset = offset}}};
+  }
+
+  auto async_read(const utils::handle &fd, std::span<std::byte> buffer,
+                  off_t offset) {
+    return throwing(try_async_read(fd, buffer, offset));
+  }
+
+  // send up to count bytes of file (starting at offset) to the socket
+  //  without copying them to user space, number of bytes sent
+  //  (io_uring has no sendfile, it waits for POLLOUT and calls it)
+  auto try_async_sendfile(const utils::handle &sock, int file,
+                          off_t offset, std::size_t count) {
+    struct awaiter : operation_awaiter {
+      io_result<std::size_t> await_resume() {
+        if (auto ec = error())
+          return ec;
+        return static_cast<std::size_t>(op.result);
+      }
+    };
+
+    return awaiter{{*this, operation{.handle = nullptr,
+                                     .fd = sock,
+                                     .events = POLLOUT,
+                                     .timeout = std::chrono::steady_clock::time_point::max(),
+                                     .kind = op_kind::sendfile,
+                                     .length = count,
+                                     .offset = offset,
+                                     .source = file}}};
+  }
+
+  auto async_sendfile(const utils::handle &sock, int file,
+                      off_t offset, std::size_t count) {
+    return throwing(try_async_sendfile(sock, file, offset, count));
   }
 
   struct poll_error : std::runtime_error {
@@ -469,6 +747,16 @@ public:
   };
 
 private:
+  enum class op_kind : std::uint8_t {
+    poll,
+    recv,
+    send,
+    sendmsg,
+    accept,
+    read,
+    sendfile
+  };
+
   struct operation {
     std::coroutine_handle<> handle;
     int fd;
@@ -476,12 +764,160 @@ private:
     std::chrono::time_point<std::chrono::steady_clock> timeout;
 
     short revents = 0;
+    std::error_code error{};
+
+    // only set when the engine is destroyed under the operation
     std::exception_ptr exception = nullptr;
+
+    // position in io_engine::timers
+    std::size_t timer_index = not_queued;
+
+    // completion based operations (events is the readiness they wait for)
+    op_kind kind = op_kind::poll;
+    std::byte *buffer = nullptr; // sendmsg: the msghdr
+    std::size_t length = 0;
+    off_t offset = 0;
+    int source = -1; // sendfile: file the data comes from
+    int flags = 0;   // sendmsg: MSG_* flags besides MSG_NOSIGNAL
+    ssize_t result = 0;
+    bool timed_out = false;
+
+    // io_uring: in-flight entry is a POLL_ADD waiting to retry the operation
+    bool polling = false;
+
+    // io_uring: position in io_engine::submitted while in flight
+    std::size_t submitted_index = not_queued;
+  };
+
+  struct operation_awaiter {
+    io_engine &engine;
+    operation op;
+
+    bool await_ready() { return engine.try_perform(&op); }
+    void await_suspend(std::coroutine_handle<> handle) {
+      op.handle = handle;
+      engine.add_operation(&op);
+    }
+
+  protected:
+    std::error_code error() const {
+      if (op.exception)
+        std::rethrow_exception(op.exception);
+      return op.error;
+    }
+  };
+
+  // awaiter of the throwing version of a try_* awaitable
+  template <typename Awaiter> struct throwing_awaiter : Awaiter {
+    auto await_resume() { return Awaiter::await_resume().value(); }
+  };
+
+  template <typename Awaiter>
+  static throwing_awaiter<Awaiter> throwing(Awaiter awaiter) {
+    return throwing_awaiter<Awaiter>{std::move(awaiter)};
+  }
+
+  // all waiters of a single fd in the epoll set (armed as EPOLLONESHOT)
+  struct registration {
+    std::vector<operation *> waiters;
+    std::uint32_t armed = 0;
   };
 
   void add_operation(operation *op);
-  void do_pull(std::function<int(std::span<pollfd>)> poll_fn);
+  void do_pull(bool wait);
+
+  // ready coroutines are queued by class and resumed in this order
+  enum class priority : std::uint8_t { accept, timer, io };
+  static constexpr std::size_t priority_count = 3;
+
+  // coroutines resumed per iteration before the backend is polled again
+  //  (the rest stays queued and the next poll does not block)
+  static constexpr std::size_t run_budget = 256;
+
+  struct ready_entry {
+    std::coroutine_handle<> handle;
+    std::chrono::steady_clock::time_point since;
+  };
 
+  static priority priority_of(const operation *op);
+  void make_ready(std::span<operation *const> ops);
+  void run_ready();
+
+  void clear_wakeup();
+  void queue_posted();
+
+  static void set_poll_error(operation *op);
+  static bool perform(operation *op);
+  bool try_perform(operation *op);
+  static bool has_timer(const operation *op);
+  auto all_operations() const -> std::vector<operation *>;
+  void dump_operations() const;
+
+  int poll_wait(std::span<pollfd> fds, bool wait) const;
+  void poll_pull(bool wait);
+
+  void epoll_add(operation *op);
+  std::error_code epoll_arm(int fd, registration &reg);
+  void epoll_pull(bool wait);
+
+  bool uring_submitted(const operation *op) const;
+  void uring_submit(operation *op);
+  void uring_cancel(operation *op);
+  void uring_track(operation *op);
+  void uring_untrack(operation *op);
+  void uring_watch_wakeup();
+  void uring_pull(bool wait);
+
+  backend type;
+
+  // all operations that have not been resumed yet (poll backend only)
   std::vector<operation *> operations;
+
+  // pending operations with a deadline (and all wait_until operations)
+  timer_queue<operation> timers;
+
+  utils::handle epoll_fd;
+  std::unordered_map<int, registration> registrations;
+
+  std::unique_ptr<uring> ring;
+  // operations the kernel has (each is cancelled by its user_data when the
+  //  engine is destroyed)
+  std::vector<operation *> submitted;
+
+  // coroutines posted by other threads (wake_fd is an eventfd that is always
+  //  watched by the backend)
+  utils::handle wake_fd;
+  std::mutex posted_mutex;
+  std::vector<std::coroutine_handle<>> posted;
+  std::atomic<std::size_t> remote_pending = 0;
+
+  std::size_t pending = 0;
+
+  std::array<std::deque<ready_entry>, priority_count> run_queue;
+  std::size_t queued = 0;
+
+  // only written by the engine thread, read by stats()
+  std::atomic<std::size_t> queue_depth = 0;
+  std::atomic<std::size_t> peak_queue_depth = 0;
+  std::atomic<std::int64_t> lag_ns = 0;
+  std::atomic<std::int64_t> max_lag_ns = 0;
+  std::atomic<std::size_t> pending_count = 0;
+  std::atomic<std::uint64_t> iteration_count = 0;
+  std::atomic<std::int64_t> poll_ns = 0;
+
+  struct atomic_counters {
+    std::atomic<std::uint64_t> calls = 0;
+    std::atomic<std::uint64_t> hits = 0;
+
+    void count(bool hit);
+    fast_path_counters load() const;
+  };
+
+  atomic_counters fast_recv;
+  atomic_counters fast_send;
+  atomic_counters fast_accept;
 };
+
+std::string_view to_string(io_engine::backend type);
+io_engine::backend backend_from_string(std::string_view name);
 } // namespace coro
\ No newline at end of file
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+namespace coro {
+// errors reported through the poll flags of a file descriptor
+enum class poll_errc { pollerr = 1, pollhup, pollnval };
+
+const std::error_category &poll_category() noexcept;
+
+inline std::error_code make_error_code(poll_errc e) noexcept {
+  return {static_cast<int>(e), poll_category()};
+}
+
+// throws the exception type matching the error (io_engine::poll_error
+//  subclasses for poll_errc, std::system_error otherwise)
+[[noreturn]] void throw_io_error(std::error_code error);
+} // namespace coro
+
+template <> struct std::is_error_code_enum<coro::poll_errc> : std::true_type {};
+
+namespace coro {
+/*
+value or error of an io_engine operation (a minimal std::expected)
+
+the try_* awaitables return it so that failing and disconnecting clients
+do not have to go through exceptions
+*/
+template <typename T> class io_result {
+public:
+  io_result(T value) : val(std::move(value)) {}
+  io_result(std::error_code error) : err(error) {}
+  io_result(poll_errc error) : err(error) {}
+
+  bool has_value() const { return !err; }
+  explicit operator bool() const { return has_value(); }
+
+  std::error_code error() const { return err; }
+
+  T &value() & {
+    check();
+    return val;
+  }
+  T value() && {
+    check();
+    return std::move(val);
+  }
+
+  T &operator*() { return val; }
+  const T &operator*() const { return val; }
+  T *operator->() { return &val; }
+  const T *operator->() const { return &val; }
+
+private:
+  void check() const {
+    if (err)
+      throw_io_error(err);
+  }
+
+  T val{};
+  std::error_code err;
+};
+} // namespace coro
@@ -0,0 +1,93 @@
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <charconv>
+
+using namespace io;
+
+latency_histogram::counts &
+latency_histogram::counts::operator+=(const counts &other) {
+  for (std::size_t i = 0; i < buckets.size(); ++i)
+    buckets[i] += other.buckets[i];
+
+  sum += other.sum;
+  return *this;
+}
+
+void latency_histogram::record(std::chrono::nanoseconds latency,
+                               std::uint64_t count) {
+  // first bucket whose bound is not below the latency (+Inf past the end)
+  auto bucket = std::ranges::lower_bound(bounds, latency) - bounds.begin();
+
+  buckets[bucket].fetch_add(count, std::memory_order_relaxed);
+  sum_ns.fetch_add(latency.count() * count, std::memory_order_relaxed);
+}
+
+latency_histogram::counts latency_histogram::load() const {
+  counts res;
+  for (std::size_t i = 0; i < buckets.size(); ++i)
+    res.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+
+  res.sum = std::chrono::nanoseconds(sum_ns.load(std::memory_order_relaxed));
+  return res;
+}
+
+void metrics_text::family(std::string_view name, std::string_view type,
+                          std::string_view help) {
+  out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+  out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+}
+
+void metrics_text::begin_sample(std::string_view name,
+                                std::string_view labels) {
+  out.append(name);
+  if (!labels.empty())
+    out.append("{").append(labels).append("}");
+  out.append(" ");
+}
+
+void metrics_text::sample(std::string_view name, std::string_view labels,
+                          std::uint64_t value) {
+  begin_sample(name, labels);
+  out.append(std::to_string(value)).append("\n");
+}
+
+void metrics_text::sample(std::string_view name, std::string_view labels,
+                          double value) {
+  begin_sample(name, labels);
+
+  std::array<char, 32> text;
+  auto [end, ec] = std::to_chars(text.data(), text.data() + text.size(), value);
+  out.append(text.data(), end).append("\n");
+}
+
+void metrics_text::sample(std::string_view name, std::string_view labels,
+                          std::chrono::nanoseconds value) {
+  sample(name, labels, std::chrono::duration<double>(value).count());
+}
+
+void metrics_text::histogram(std::string_view name,
+                             const latency_histogram::counts &value) {
+  std::string bucket(name);
+  bucket.append("_bucket");
+
+  std::uint64_t cumulative = 0;
+  for (std::size_t i = 0; i < value.buckets.size(); ++i) {
+    cumulative += value.buckets[i];
+
+    std::string le = "le=\"+Inf\"";
+    if (i < latency_histogram::bounds.size()) {
+      std::array<char, 32> text;
+      auto [end, ec] = std::to_chars(
+          text.data(), text.data() + text.size(),
+          std::chrono::duration<double>(latency_histogram::bounds[i]).count(),
+          std::chars_format::fixed);
+      le = "le=\"" + std::string(text.data(), end) + "\"";
+    }
+
+    sample(bucket, le, cumulative);
+  }
+
+  sample(std::string(name) + "_sum", {}, value.sum);
+  sample(std::string(name) + "_count", {}, cumulative);
+}
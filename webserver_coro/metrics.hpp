@@ -0,0 +1,77 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace io {
+/*
+request latencies counted into fixed buckets (a Prometheus histogram)
+
+meant to be kept per event loop: record() is a few relaxed atomic adds,
+load() can be called from any thread and the loads of all loops are summed
+up when the metrics are scraped
+*/
+class latency_histogram {
+public:
+  // upper bounds of the buckets (the last one, +Inf, is implicit)
+  static constexpr std::array<std::chrono::nanoseconds, 15> bounds{
+      std::chrono::microseconds(100), std::chrono::microseconds(250),
+      std::chrono::microseconds(500), std::chrono::milliseconds(1),
+      std::chrono::microseconds(2500), std::chrono::milliseconds(5),
+      std::chrono::milliseconds(10), std::chrono::milliseconds(25),
+      std::chrono::milliseconds(50), std::chrono::milliseconds(100),
+      std::chrono::milliseconds(250), std::chrono::milliseconds(500),
+      std::chrono::seconds(1), std::chrono::milliseconds(2500),
+      std::chrono::seconds(5)};
+
+  struct counts {
+    std::array<std::uint64_t, bounds.size() + 1> buckets{}; // not cumulative
+    std::chrono::nanoseconds sum{};
+
+    counts &operator+=(const counts &other);
+  };
+
+  void record(std::chrono::nanoseconds latency, std::uint64_t count = 1);
+  counts load() const;
+
+private:
+  std::array<std::atomic<std::uint64_t>, bounds.size() + 1> buckets{};
+  std::atomic<std::int64_t> sum_ns = 0;
+};
+
+/*
+text of a Prometheus scrape (exposition format 0.0.4)
+
+every metric starts with family() and is followed by its samples, labels are
+given preformatted (`code="200"`) and are not escaped
+*/
+class metrics_text {
+public:
+  static constexpr std::string_view content_type =
+      "text/plain; version=0.0.4; charset=utf-8";
+
+  // type is counter, gauge or histogram
+  void family(std::string_view name, std::string_view type,
+              std::string_view help);
+
+  void sample(std::string_view name, std::string_view labels,
+              std::uint64_t value);
+  void sample(std::string_view name, std::string_view labels, double value);
+  void sample(std::string_view name, std::string_view labels,
+              std::chrono::nanoseconds value); // in seconds
+
+  // the _bucket, _sum and _count samples of a histogram family
+  void histogram(std::string_view name, const latency_histogram::counts &value);
+
+  const std::string &str() const { return out; }
+
+private:
+  void begin_sample(std::string_view name, std::string_view labels);
+
+  std::string out;
+};
+} // namespace io
@@ -0,0 +1,94 @@
+#include "thread_pool.hpp"
+
+#include <algorithm>
+
+using namespace coro;
+
+namespace {
+// pool and queue of the worker running on this thread (if any)
+thread_local const thread_pool *current_pool = nullptr;
+thread_local std::size_t current_queue = 0;
+} // namespace
+
+thread_pool::thread_pool(unsigned threads) {
+  threads = std::max(threads, 1u);
+
+  queues.reserve(threads);
+  for (unsigned i = 0; i < threads; ++i)
+    queues.push_back(std::make_unique<worker_queue>());
+
+  workers.reserve(threads);
+  for (unsigned i = 0; i < threads; ++i)
+    workers.emplace_back([this, i](std::stop_token stop) { run(stop, i); });
+}
+
+thread_pool::~thread_pool() {
+  for (auto &worker : workers)
+    worker.request_stop();
+
+  wake.notify_all();
+  workers.clear();
+}
+
+void thread_pool::push(std::coroutine_handle<> handle) {
+  // workers keep their own tasks local, others are spread round-robin
+  std::size_t id = current_pool == this
+                       ? current_queue
+                       : next_queue.fetch_add(1, std::memory_order_relaxed) %
+                             queues.size();
+
+  {
+    std::lock_guard lock(queues[id]->mutex);
+    queues[id]->tasks.push_back(handle);
+  }
+
+  queued.fetch_add(1, std::memory_order_release);
+
+  // taking the lock makes sure a worker that is about to sleep sees the task
+  { std::lock_guard lock(sleep_mutex); }
+  wake.notify_one();
+}
+
+std::coroutine_handle<> thread_pool::pop(std::size_t id) {
+  {
+    auto &own = *queues[id];
+    std::lock_guard lock(own.mutex);
+    if (!own.tasks.empty()) {
+      auto handle = own.tasks.back();
+      own.tasks.pop_back();
+      queued.fetch_sub(1, std::memory_order_relaxed);
+      return handle;
+    }
+  }
+
+  // steal the oldest task of somebody else
+  for (std::size_t i = 1; i < queues.size(); ++i) {
+    auto &victim = *queues[(id + i) % queues.size()];
+    std::lock_guard lock(victim.mutex);
+    if (!victim.tasks.empty()) {
+      auto handle = victim.tasks.front();
+      victim.tasks.pop_front();
+      queued.fetch_sub(1, std::memory_order_relaxed);
+      return handle;
+    }
+  }
+
+  return nullptr;
+}
+
+void thread_pool::run(std::stop_token stop, std::size_t id) {
+  current_pool = this;
+  current_queue = id;
+
+  while (!stop.stop_requested()) {
+    if (auto handle = pop(id)) {
+      handle.resume();
+      continue;
+    }
+
+    std::unique_lock lock(sleep_mutex);
+    wake.wait(lock, stop, [&] {
+      return queued.load(std::memory_order_acquire) != 0;
+    });
+  }
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include "io_engine.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace coro {
+/*
+work-stealing pool of worker threads for CPU heavy parts of coroutines
+
+every worker owns a deque: it pushes and pops its own tasks at the back and
+steals from the front of the other deques when it runs out of work.
+Coroutines hop onto the pool with `co_await pool.schedule()` and back onto
+their io_engine with `co_await engine.schedule()` (see offload()).
+*/
+class thread_pool {
+public:
+  explicit thread_pool(unsigned threads = std::thread::hardware_concurrency());
+  thread_pool(const thread_pool &) = delete;
+  thread_pool &operator=(const thread_pool &) = delete;
+  thread_pool(thread_pool &&) = delete;
+  thread_pool &operator=(thread_pool &&) = delete;
+
+  // stops the workers (tasks that are still queued are never resumed)
+  ~thread_pool();
+
+  std::size_t size() const { return queues.size(); }
+
+  // resume the awaiting coroutine on one of the workers
+  auto schedule() {
+    struct awaiter {
+      thread_pool &pool;
+
+      bool await_ready() const { return false; }
+      void await_suspend(std::coroutine_handle<> handle) { pool.push(handle); }
+      void await_resume() {}
+    };
+
+    return awaiter{*this};
+  }
+
+private:
+  struct worker_queue {
+    std::mutex mutex;
+    std::deque<std::coroutine_handle<>> tasks;
+  };
+
+  void push(std::coroutine_handle<> handle);
+  std::coroutine_handle<> pop(std::size_t id);
+  void run(std::stop_token stop, std::size_t id);
+
+  std::vector<std::unique_ptr<worker_queue>> queues;
+
+  // idle workers sleep until something is queued
+  std::mutex sleep_mutex;
+  std::condition_variable_any wake;
+  std::atomic<std::size_t> queued = 0;
+  std::atomic<std::size_t> next_queue = 0;
+
+  std::vector<std::jthread> workers;
+};
+
+// run fn on the pool and resume the caller on the engine thread afterwards
+//  (exceptions thrown by fn are rethrown on the engine thread)
+template <typename Fn>
+lazy_task<std::invoke_result_t<Fn &>> offload(thread_pool &pool,
+                                              io_engine &engine, Fn fn) {
+  using T = std::invoke_result_t<Fn &>;
+
+  engine.retain();
+  co_await pool.schedule();
+
+  std::exception_ptr exception = nullptr;
+  std::conditional_t<std::is_void_v<T>, bool, std::optional<T>> result{};
+
+  try {
+    if constexpr (std::is_void_v<T>)
+      fn();
+    else
+      result = fn();
+  } catch (...) {
+    exception = std::current_exception();
+  }
+
+  co_await engine.schedule();
+  engine.release();
+
+  if (exception)
+    std::rethrow_exception(exception);
+
+  if constexpr (!std::is_void_v<T>)
+    co_return std::move(*result);
+}
+} // namespace coro
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <chrono>
+#include <concepts>
+#include <cstddef>
+#include <limits>
+#include <utility>
+#include <vector>
+
+namespace coro {
+
+// timer_index of entries that are not in any timer_queue
+inline constexpr std::size_t not_queued = std::numeric_limits<std::size_t>::max();
+
+template <typename T>
+concept timer_entry = requires(T &t) {
+  { t.timeout } -> std::convertible_to<std::chrono::steady_clock::time_point>;
+  { t.timer_index } -> std::convertible_to<std::size_t>;
+};
+
+/*
+binary min-heap of deadlines where every entry remembers its position
+(timer_index), so arming, cancelling and expiring a deadline is O(log n)
+and looking up the earliest one is O(1)
+*/
+template <timer_entry T> class timer_queue {
+public:
+  bool empty() const { return heap.empty(); }
+  std::size_t size() const { return heap.size(); }
+
+  static bool contains(const T *entry) { return entry->timer_index != not_queued; }
+
+  auto earliest() const -> std::chrono::steady_clock::time_point {
+    return heap.empty() ? std::chrono::steady_clock::time_point::max()
+                        : heap.front()->timeout;
+  }
+
+  T *top() const { return heap.front(); }
+
+  void push(T *entry) {
+    entry->timer_index = heap.size();
+    heap.push_back(entry);
+    sift_up(entry->timer_index);
+  }
+
+  // no-op if the entry is not in the queue
+  void erase(T *entry) {
+    std::size_t i = entry->timer_index;
+    if (i == not_queued)
+      return;
+
+    entry->timer_index = not_queued;
+
+    if (i + 1 == heap.size()) {
+      heap.pop_back();
+      return;
+    }
+
+    heap[i] = heap.back();
+    heap[i]->timer_index = i;
+    heap.pop_back();
+
+    if (i > 0 && heap[i]->timeout < heap[parent(i)]->timeout)
+      sift_up(i);
+    else
+      sift_down(i);
+  }
+
+  T *pop() {
+    T *entry = heap.front();
+    erase(entry);
+    return entry;
+  }
+
+  // entries in heap order (for debugging)
+  auto begin() const { return heap.begin(); }
+  auto end() const { return heap.end(); }
+
+private:
+  static std::size_t parent(std::size_t i) { return (i - 1) / 2; }
+
+  void swap(std::size_t a, std::size_t b) {
+    std::swap(heap[a], heap[b]);
+    heap[a]->timer_index = a;
+    heap[b]->timer_index = b;
+  }
+
+  void sift_up(std::size_t i) {
+    while (i > 0 && heap[i]->timeout < heap[parent(i)]->timeout) {
+      swap(i, parent(i));
+      i = parent(i);
+    }
+  }
+
+  void sift_down(std::size_t i) {
+    while (true) {
+      std::size_t smallest = i;
+      std::size_t left = 2 * i + 1;
+      std::size_t right = left + 1;
+
+      if (left < heap.size() && heap[left]->timeout < heap[smallest]->timeout)
+        smallest = left;
+      if (right < heap.size() && heap[right]->timeout < heap[smallest]->timeout)
+        smallest = right;
+
+      if (smallest == i)
+        return;
+
+      swap(i, smallest);
+      i = smallest;
+    }
+  }
+
+  std::vector<T *> heap;
+};
+} // namespace coro
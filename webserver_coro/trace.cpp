@@ -0,0 +1,91 @@
+#include "trace.hpp"
+
+#include <algorithm>
+#include <iomanip>
+#include <stdexcept>
+
+using namespace io;
+
+trace_ring::trace_ring(std::size_t capacity)
+    : capacity(capacity), slots(std::make_unique<slot[]>(capacity)) {
+  if (capacity == 0)
+    throw std::invalid_argument("trace ring without capacity");
+}
+
+void trace_ring::record(const char *name, std::uint64_t start,
+                        std::uint64_t end, std::uint32_t connection,
+                        std::uint32_t count) {
+  auto index = written.load(std::memory_order_relaxed);
+  auto &s = slots[index % capacity];
+
+  // a reader that sees any of the new fields also sees `begun`
+  begun.store(index + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  s.name.store(name, std::memory_order_relaxed);
+  s.start.store(start, std::memory_order_relaxed);
+  s.duration.store(end > start ? end - start : 0, std::memory_order_relaxed);
+  s.connection.store(connection, std::memory_order_relaxed);
+  s.count.store(count, std::memory_order_relaxed);
+
+  written.store(index + 1, std::memory_order_release);
+}
+
+std::vector<trace_ring::span> trace_ring::snapshot() const {
+  auto end = written.load(std::memory_order_acquire);
+  auto first = end > capacity ? end - capacity : 0;
+
+  std::vector<span> res;
+  res.reserve(end - first);
+
+  for (auto i = first; i < end; ++i) {
+    const auto &s = slots[i % capacity];
+    res.push_back({s.name.load(std::memory_order_relaxed),
+                   s.start.load(std::memory_order_relaxed),
+                   s.duration.load(std::memory_order_relaxed),
+                   s.connection.load(std::memory_order_relaxed),
+                   s.count.load(std::memory_order_relaxed)});
+  }
+
+  // slots reused by spans begun in the meantime may be torn
+  std::atomic_thread_fence(std::memory_order_acquire);
+  auto reused = begun.load(std::memory_order_relaxed);
+  auto valid = reused > capacity ? reused - capacity : 0;
+
+  if (valid > first)
+    res.erase(res.begin(),
+              res.begin() + std::min<std::size_t>(valid - first, res.size()));
+
+  return res;
+}
+
+void io::write_chrome_trace(
+    std::ostream &out, std::span<const std::vector<trace_ring::span>> loops) {
+  out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+
+  bool first = true;
+  auto separator = [&] {
+    if (!first)
+      out << ",\n";
+    first = false;
+  };
+
+  // timestamps are microseconds (with nanosecond fractions)
+  out << std::fixed << std::setprecision(3);
+
+  for (std::size_t loop = 0; loop < loops.size(); ++loop) {
+    separator();
+    out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << loop
+        << ",\"args\":{\"name\":\"loop " << loop << "\"}}";
+
+    for (const auto &s : loops[loop]) {
+      separator();
+      out << "{\"name\":\"" << s.name << "\",\"cat\":\"http\",\"ph\":\"X\""
+          << ",\"ts\":" << s.start / 1e3 << ",\"dur\":" << s.duration / 1e3
+          << ",\"pid\":" << loop << ",\"tid\":" << s.connection
+          << ",\"args\":{\"requests\":" << s.count << "}}";
+    }
+  }
+
+  out << "]}\n";
+}
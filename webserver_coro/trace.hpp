@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <span>
+#include <vector>
+
+namespace io {
+/*
+ring buffer of timed spans of one event loop (opt-in request tracing)
+
+only the thread of the loop records spans, the oldest ones are overwritten
+when the ring is full. snapshot() can be called from any thread, spans that
+get overwritten while it copies them are left out
+*/
+class trace_ring {
+public:
+  struct span {
+    const char *name = nullptr; // string literal
+    std::uint64_t start = 0;    // steady clock, nanoseconds
+    std::uint64_t duration = 0;
+    std::uint32_t connection = 0;
+    std::uint32_t count = 0; // requests the span covers
+  };
+
+  explicit trace_ring(std::size_t capacity);
+  trace_ring(const trace_ring &) = delete;
+  trace_ring &operator=(const trace_ring &) = delete;
+
+  static std::uint64_t ticks(std::chrono::steady_clock::time_point at) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               at.time_since_epoch())
+        .count();
+  }
+  static std::uint64_t now() { return ticks(std::chrono::steady_clock::now()); }
+
+  void record(const char *name, std::uint64_t start, std::uint64_t end,
+              std::uint32_t connection, std::uint32_t count = 1);
+
+  // oldest first
+  std::vector<span> snapshot() const;
+
+private:
+  // fields are relaxed atomics so that snapshot() may race with record()
+  struct slot {
+    std::atomic<const char *> name = nullptr;
+    std::atomic<std::uint64_t> start = 0;
+    std::atomic<std::uint64_t> duration = 0;
+    std::atomic<std::uint32_t> connection = 0;
+    std::atomic<std::uint32_t> count = 0;
+  };
+
+  const std::size_t capacity;
+  std::unique_ptr<slot[]> slots;
+
+  // spans whose slot the writer started to fill and spans completely
+  //  written (a snapshot drops what `begun` says may have been overwritten)
+  std::atomic<std::uint64_t> begun = 0;
+  std::atomic<std::uint64_t> written = 0;
+};
+
+// Chrome trace event (Perfetto) JSON of the spans of all loops: a loop is a
+//  process and each of its connections a thread of the trace
+void write_chrome_trace(std::ostream &out,
+                        std::span<const std::vector<trace_ring::span>> loops);
+} // namespace io
@@ -0,0 +1,161 @@
+#include "uring.hpp"
+
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <system_error>
+
+using namespace coro;
+
+namespace {
+int io_uring_setup(unsigned entries, io_uring_params *p) {
+  return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+}
+
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                   unsigned flags, const void *arg, std::size_t argsz) {
+  return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit,
+                                  min_complete, flags, arg, argsz));
+}
+
+int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+  return static_cast<int>(
+      syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+void *map_ring(int fd, std::size_t size, off_t offset) {
+  void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, offset);
+  if (ptr == MAP_FAILED)
+    utils::throw_sys_error("mmap");
+  return ptr;
+}
+
+template <typename T> T *at(void *base, unsigned offset) {
+  return reinterpret_cast<T *>(static_cast<char *>(base) + offset);
+}
+} // namespace
+
+uring::uring(unsigned entries) {
+  fd = utils::handle(io_uring_setup(entries, &params));
+  if (!fd)
+    utils::throw_sys_error("io_uring_setup");
+
+  // we wait with a timeout (EXT_ARG) and rely on the kernel to keep
+  //  overflowing completions (NODROP)
+  if (!(params.features & IORING_FEAT_EXT_ARG) ||
+      !(params.features & IORING_FEAT_NODROP))
+    throw std::system_error(ENOSYS, std::system_category(),
+                            "io_uring: missing features");
+
+  try {
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+      sq_ring = cq_ring = map_ring(fd, sq_ring_size, IORING_OFF_SQ_RING);
+    } else {
+      sq_ring = map_ring(fd, sq_ring_size, IORING_OFF_SQ_RING);
+      cq_ring = map_ring(fd, cq_ring_size, IORING_OFF_CQ_RING);
+    }
+
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = static_cast<io_uring_sqe *>(map_ring(fd, sqes_size, IORING_OFF_SQES));
+  } catch (...) {
+    unmap();
+    throw;
+  }
+
+  sq_head = at<unsigned>(sq_ring, params.sq_off.head);
+  sq_tail = at<unsigned>(sq_ring, params.sq_off.tail);
+  sq_mask = at<unsigned>(sq_ring, params.sq_off.ring_mask);
+  sq_array = at<unsigned>(sq_ring, params.sq_off.array);
+  sqe_tail = *sq_tail;
+
+  // submission entries are always used in order
+  for (unsigned i = 0; i < params.sq_entries; ++i)
+    sq_array[i] = i;
+
+  cq_head = at<unsigned>(cq_ring, params.cq_off.head);
+  cq_tail = at<unsigned>(cq_ring, params.cq_off.tail);
+  cq_mask = at<unsigned>(cq_ring, params.cq_off.ring_mask);
+  cqes = at<io_uring_cqe>(cq_ring, params.cq_off.cqes);
+
+  // find out which operations are supported by the kernel
+  constexpr unsigned probe_ops = 256;
+  std::size_t probe_size =
+      sizeof(io_uring_probe) + probe_ops * sizeof(io_uring_probe_op);
+  auto probe_buf = std::make_unique<std::byte[]>(probe_size);
+  std::memset(probe_buf.get(), 0, probe_size);
+  auto *probe = reinterpret_cast<io_uring_probe *>(probe_buf.get());
+
+  if (io_uring_register(fd, IORING_REGISTER_PROBE, probe, probe_ops) == -1) {
+    int err = errno;
+    unmap();
+    throw std::system_error(err, std::system_category(),
+                            "io_uring_register(PROBE)");
+  }
+
+  supported_ops.resize(probe->ops_len);
+  for (unsigned i = 0; i < probe->ops_len; ++i)
+    supported_ops[probe->ops[i].op] =
+        probe->ops[i].flags & IO_URING_OP_SUPPORTED;
+}
+
+uring::~uring() { unmap(); }
+
+void uring::unmap() {
+  if (sqes)
+    munmap(sqes, sqes_size);
+  if (cq_ring && cq_ring != sq_ring)
+    munmap(cq_ring, cq_ring_size);
+  if (sq_ring)
+    munmap(sq_ring, sq_ring_size);
+
+  sqes = nullptr;
+  sq_ring = cq_ring = nullptr;
+}
+
+io_uring_sqe *uring::get_sqe() {
+  while (queued() >= params.sq_entries) {
+    if (submit_and_wait(0) == -1 && errno != EINTR && errno != EBUSY)
+      utils::throw_sys_error("io_uring_enter");
+  }
+
+  io_uring_sqe *sqe = &sqes[sqe_tail & *sq_mask];
+  std::memset(sqe, 0, sizeof(*sqe));
+  ++sqe_tail;
+  return sqe;
+}
+
+int uring::submit_and_wait(unsigned wait_nr,
+                           const __kernel_timespec *timeout) {
+  std::atomic_ref(*sq_tail).store(sqe_tail, std::memory_order_release);
+
+  unsigned flags = 0;
+  const void *arg = nullptr;
+  std::size_t argsz = 0;
+
+  io_uring_getevents_arg ext_arg{};
+  if (wait_nr > 0) {
+    flags |= IORING_ENTER_GETEVENTS;
+
+    if (timeout) {
+      ext_arg.sigmask_sz = _NSIG / 8;
+      ext_arg.ts = reinterpret_cast<std::uint64_t>(timeout);
+      flags |= IORING_ENTER_EXT_ARG;
+      arg = &ext_arg;
+      argsz = sizeof(ext_arg);
+    }
+  }
+
+  return io_uring_enter(fd, queued(), wait_nr, flags, arg, argsz);
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "utils.hpp"
+
+#include <linux/io_uring.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace coro {
+/*
+minimal io_uring wrapper on top of the raw syscalls (no liburing)
+
+submission entries are only queued by get_sqe() and handed to the kernel by
+submit_and_wait(), so a whole loop iteration costs a single io_uring_enter
+*/
+class uring {
+public:
+  // throws std::system_error if the kernel refuses to set up the ring or
+  //  lacks the features we rely on
+  explicit uring(unsigned entries);
+  uring(const uring &) = delete;
+  uring &operator=(const uring &) = delete;
+  uring(uring &&) = delete;
+  uring &operator=(uring &&) = delete;
+
+  ~uring();
+
+  bool supports(std::uint8_t opcode) const {
+    return opcode < supported_ops.size() && supported_ops[opcode];
+  }
+
+  // get a zeroed submission entry (submits queued entries if the ring is full)
+  io_uring_sqe *get_sqe();
+
+  // submit all queued entries and wait for at least wait_nr completions
+  //  (or until timeout passes). Returns -1 and sets errno on failure
+  int submit_and_wait(unsigned wait_nr,
+                      const __kernel_timespec *timeout = nullptr);
+
+  // call fn for every available completion entry and consume them
+  template <typename Fn> unsigned for_each_cqe(Fn &&fn) {
+    unsigned head = *cq_head;
+    unsigned tail = std::atomic_ref(*cq_tail).load(std::memory_order_acquire);
+    unsigned count = tail - head;
+
+    for (; head != tail; ++head)
+      fn(cqes[head & *cq_mask]);
+
+    std::atomic_ref(*cq_head).store(head, std::memory_order_release);
+    return count;
+  }
+
+private:
+  void unmap();
+
+  unsigned queued() const {
+    return sqe_tail - std::atomic_ref(*sq_head).load(std::memory_order_acquire);
+  }
+
+  utils::handle fd;
+  io_uring_params params{};
+
+  void *sq_ring = nullptr;
+  void *cq_ring = nullptr;
+  std::size_t sq_ring_size = 0;
+  std::size_t cq_ring_size = 0;
+
+  io_uring_sqe *sqes = nullptr;
+  std::size_t sqes_size = 0;
+
+  unsigned *sq_head = nullptr;
+  unsigned *sq_tail = nullptr;
+  unsigned *sq_mask = nullptr;
+  unsigned *sq_array = nullptr;
+  unsigned sqe_tail = 0;
+
+  unsigned *cq_head = nullptr;
+  unsigned *cq_tail = nullptr;
+  unsigned *cq_mask = nullptr;
+  io_uring_cqe *cqes = nullptr;
+
+  std::vector<bool> supported_ops;
+};
+} // namespace coro
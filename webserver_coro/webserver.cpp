@@ -1,82 +1,127 @@
+#include "access_log.hpp"
+#include "buffer_pool.hpp"
+#include "frame_pool.hpp"
+#include "host_roots.hpp"
 #include "httpInfo.hpp"
 #include "io.hpp"
+#include "metrics.hpp"
+#include "request_parser.hpp"
 #include "io_engine.hpp"
+#include "thread_pool.hpp"
+#include "trace.hpp"
 #include "utils.hpp"
 
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
 #include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <optional>
 #include <random>
-#include <ranges>
+#include <span>
+#include <string>
 #include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
 
 namespace {
-http::request get_request_data(std::string_view request,
-                               const std::filesystem::path &directory) {
-  // request format: <method> <path> <version>\r\n<headers>\r\n
-  using namespace std::literals;
-  auto lines = std::views::split(request, "\r\n"sv);
+// status codes the server answers with (alternatives of http::request)
+constexpr std::array<int, 11> status_codes{200, 206, 301, 304, 403, 404,
+                                           416, 431, 500, 501, 503};
+static_assert(status_codes.size() ==
+              std::variant_size_v<decltype(http::request::data)>);
 
-  if (std::ranges::distance(lines) <= 2)
-    return {};
+// per event loop counters (only written by the owning thread)
+struct alignas(64) worker_stats {
+  std::atomic<std::uint64_t> accepted = 0;
+  std::atomic<std::uint64_t> closed = 0;
+  std::atomic<std::uint64_t> requests = 0;
+  std::atomic<std::uint64_t> shed = 0; // answered with 503 right away
 
-  auto parts = std::views::split(lines.front(), " "sv);
-  if (std::ranges::distance(parts) != 3)
-    return {};
+  // responses by status code (index in status_codes) and bytes sent
+  std::array<std::atomic<std::uint64_t>, status_codes.size()> responses{};
+  std::atomic<std::uint64_t> sent = 0;
 
-  auto to_sv = [](const auto &s) {
-    return std::string_view{s.begin(), s.end()};
-  };
+  // from the first byte of a request head to its response being sent
+  io::latency_histogram latency;
 
-  auto it = parts.begin();
-  std::string_view method = to_sv(*it);
-  std::filesystem::path path = to_sv(*++it);
-  std::string_view version = to_sv(*++it);
+  void count_response(int status) {
+    auto it = std::ranges::find(status_codes, status);
+    if (it != status_codes.end())
+      responses[it - status_codes.begin()].fetch_add(
+          1, std::memory_order_relaxed);
+  }
 
-  if (method != "GET")
-    return {};
+  // event loop of the thread, its connection buffers and its trace (while
+  //  it runs)
+  std::atomic<const coro::io_engine *> engine = nullptr;
+  std::atomic<const io::buffer_pool *> buffers = nullptr;
+  std::atomic<const io::trace_ring *> trace = nullptr;
+};
 
-  if (version != "HTTP/1.1")
-    return {};
+// listener of an event loop waiting at the connection cap, the connection
+//  that frees a slot posts it back to its loop (instead of it polling the
+//  count)
+struct alignas(64) parked_listener {
+  coro::io_engine *engine = nullptr; // set before the listener starts
+  std::atomic<void *> handle = nullptr; // address of the parked coroutine
+};
 
-  // file path is at directory/host/path
+// state shared by all event loops (lives as long as main)
+struct server_state {
+  const http::host_roots *roots = nullptr;
+  coro::thread_pool *pool = nullptr;
+  http::content_cache *cache = nullptr;
+  http::file_cache *files = nullptr;
+  http::gzip_cache *gzip = nullptr;
 
-  auto headers = lines | std::views::drop(1) |
-                 std::views::take(std::ranges::distance(lines) - 3) |
-                 std::views::transform(to_sv);
+  std::chrono::seconds header_timeout{};
+  std::chrono::seconds idle_timeout{};
 
-  bool keep_alive = true;
+  // connections served on all threads (at most about max_connections)
+  std::atomic<std::size_t> *connections = nullptr;
+  std::size_t max_connections = 0;
+  std::chrono::milliseconds shed_lag{};
 
-  std::string_view host;
-  for (auto line : headers) {
-    std::size_t pos = line.find(':');
-    if (pos == std::string_view::npos)
-      return {};
+  // one per event loop
+  std::span<parked_listener> listeners;
 
-    // strip whitespaces
-    auto strip = [](std::string_view sv) {
-      while (!sv.empty() && std::isspace(sv.front()))
-        sv.remove_prefix(1);
-      while (!sv.empty() && std::isspace(sv.back()))
-        sv.remove_suffix(1);
-      return sv;
-    };
+  // counters of all event loops, GET /__metrics serves them if metrics is set
+  std::span<const worker_stats> workers;
+  bool metrics = false;
 
-    auto key = strip(line.substr(0, pos));
-    auto value = strip(line.substr(pos + 1));
+  // every answered request is logged if set
+  http::access_log *log = nullptr;
+};
 
-    if (key == "Host")
-      host = value;
+constexpr std::string_view metrics_path = "/__metrics";
 
-    if (key == "Connection" && value == "close")
-      keep_alive = false;
-  }
+http::request get_request_data(const http::parsed_request &parsed,
+                               const server_state &state) {
+  if (parsed.method != "GET")
+    return {};
+
+  if (parsed.version != "HTTP/1.1")
+    return {};
+
+  std::string_view path = parsed.target;
+  std::string_view host = parsed.find("Host");
+  bool keep_alive = parsed.find("Connection") != "close";
 
   if (host.empty())
     return {};
@@ -85,92 +130,642 @@ http::request get_request_data(std::string_view request,
   if (host.find('/') != std::string::npos)
     return {};
 
-  // check if path is valid (all ".." should not move above the root directory)
-  //  make path a normal form (before that remove leading / to preserve all
-  //  leading ..)
-  path = path.lexically_proximate("/").lexically_normal();
+  std::string_view host_no_port = host.substr(0, host.find_last_of(':'));
+
+  auto *root = state.roots->find(host_no_port);
+  if (!root)
+    return {http::r404{}, keep_alive};
 
-  // if any .. survived that means we are going above the root
-  if (path.native().find("..") != std::string::npos)
-    return {http::r403{}, keep_alive}; // forbidden
+  // the kernel keeps the path beneath the root of the host (openat2), so
+  //  it is used as it came (without the leading slashes)
+  std::string_view relative =
+      path.substr(std::min(path.find_first_not_of('/'), path.size()));
+  if (relative.empty())
+    relative = ".";
 
-  std::string_view host_no_port = host.substr(0, host.find_last_of(':'));
+  // cache key directory/host/path (reuses the buffer of the thread)
+  thread_local std::string file_path;
+  file_path.assign(root->prefix);
+  file_path.append(relative);
 
-  std::filesystem::path file_path = directory / host_no_port / path;
+  // ranges are always served from the file (as it is)
+  bool ranged = !parsed.find("Range").empty();
+  auto codings =
+      ranged ? http::accept_encoding{} : http::accept_encoding::of(parsed);
 
-  if (!std::filesystem::exists(file_path))
+  // the content cache only has files as they are
+  bool compressible = http::is_compressible(http::mime_type_of(file_path));
+  bool identity = !codings.any() || !compressible;
+
+  if (state.cache && !ranged && identity) {
+    if (auto cached = state.cache->find(file_path)) {
+      if (auto r304 = http::check_not_modified(
+              parsed,
+              http::validators::of(cached->inode, cached->size,
+                                   cached->mtime))) {
+        r304->compressible = compressible;
+        return {std::move(*r304), keep_alive};
+      }
+
+      return {http::r200{{}, file_path, std::move(cached), nullptr,
+                         std::nullopt, 0},
+              keep_alive};
+    }
+  }
+
+  // a response read below may fill the content cache, it is read from the
+  //  file the path names now (an fd trusted for a while could be a file
+  //  replaced before the ticket was taken)
+  bool fills_cache = state.cache && !ranged && identity;
+  http::content_cache::ticket ticket = 0;
+  if (fills_cache)
+    ticket = state.cache->prepare(file_path);
+
+  auto file = state.files->lookup(root->fd, file_path, root->prefix.size(),
+                                  fills_cache);
+  using kind = http::file_cache::entry::kind;
+
+  if (file->type == kind::missing)
     return {http::r404{}, keep_alive};
 
-  if (std::filesystem::is_directory(file_path)) {
-    auto index_path = (host / path / "index.html").lexically_normal();
+  if (file->type == kind::forbidden)
+    return {http::r403{}, keep_alive};
+
+  if (file->type == kind::directory) {
+    auto index_path = (std::filesystem::path(host) / relative / "index.html")
+                          .lexically_normal();
     return {http::r301{{}, "http://" + index_path.generic_string()},
             keep_alive}; // permanent redirect
   }
 
-  return {http::r200{{}, file_path}, keep_alive};
+  // a precompressed sidecar or a copy from the gzip cache
+  std::optional<http::encoded_file> encoded;
+  if (!identity)
+    encoded = http::select_encoding(codings, *state.files, state.gzip,
+                                    root->fd, file_path, root->prefix.size(),
+                                    *file);
+
+  // unchanged files cost only the head
+  if (auto r304 = http::check_not_modified(
+          parsed, encoded ? encoded->tag
+                          : http::validators::of(file->st.st_ino,
+                                                 file->st.st_size,
+                                                 file->st.st_mtim))) {
+    r304->compressible = compressible;
+    return {std::move(*r304), keep_alive};
+  }
+
+  if (ranged)
+    if (auto ranges = http::requested_ranges(parsed, file->st)) {
+      if (ranges->empty())
+        return {http::r416{{}, file->st.st_size}, keep_alive};
+
+      return {http::r206{{}, file_path, std::move(file), std::move(*ranges)},
+              keep_alive};
+    }
+
+  return {http::r200{{}, file_path, nullptr, std::move(file),
+                     std::move(encoded), ticket},
+          keep_alive};
 }
 
-coro::lazy_task<bool> handle_request(
-  coro::io_engine &engine,
-  const utils::handle &sock,
-  std::string_view request,
-  const std::filesystem::path &directory) {
+// Prometheus text of the counters of all loops (summed up here, so that
+//  serving requests only touches the counters of its own loop)
+std::string collect_metrics(const server_state &state) {
+  io::metrics_text text;
+
+  auto total = [&](const std::atomic<std::uint64_t> worker_stats::*counter) {
+    std::uint64_t sum = 0;
+    for (const auto &w : state.workers)
+      sum += (w.*counter).load(std::memory_order_relaxed);
+    return sum;
+  };
+
+  auto counter = [&](std::string_view name, std::string_view help,
+                     std::uint64_t value) {
+    text.family(name, "counter", help);
+    text.sample(name, {}, value);
+  };
+
+  counter("webserver_connections_accepted_total", "Connections accepted.",
+          total(&worker_stats::accepted));
+  counter("webserver_connections_closed_total",
+          "Connections closed after they were served.",
+          total(&worker_stats::closed));
+  counter("webserver_connections_shed_total",
+          "Connections answered with 503 right away (overload).",
+          total(&worker_stats::shed));
+
+  text.family("webserver_connections_open", "gauge",
+              "Connections being served.");
+  text.sample("webserver_connections_open", {},
+              static_cast<std::uint64_t>(
+                  state.connections->load(std::memory_order_relaxed)));
+
+  text.family("webserver_responses_total", "counter",
+              "Responses by status code.");
+  for (std::size_t i = 0; i < status_codes.size(); ++i) {
+    std::uint64_t sum = 0;
+    for (const auto &w : state.workers)
+      sum += w.responses[i].load(std::memory_order_relaxed);
+
+    text.sample("webserver_responses_total",
+                "code=\"" + std::to_string(status_codes[i]) + "\"", sum);
+  }
+
+  counter("webserver_sent_bytes_total", "Bytes of responses sent.",
+          total(&worker_stats::sent));
+
+  if (state.log) {
+    auto log = state.log->stats();
+    counter("webserver_access_log_written_total",
+            "Access log lines written.", log.written);
+    counter("webserver_access_log_dropped_total",
+            "Access log lines dropped (the writer fell behind).",
+            log.dropped);
+  }
+
+  io::latency_histogram::counts latency;
+  for (const auto &w : state.workers)
+    latency += w.latency.load();
+
+  text.family("webserver_request_duration_seconds", "histogram",
+              "Time from the first byte of a request head until its "
+              "response was sent.");
+  text.histogram("webserver_request_duration_seconds", latency);
+
+  // event loops are reported one by one
+  std::vector<std::pair<std::string, coro::io_engine::statistics>> loops;
+  for (std::size_t i = 0; i < state.workers.size(); ++i)
+    if (auto *engine =
+            state.workers[i].engine.load(std::memory_order_acquire))
+      loops.emplace_back("loop=\"" + std::to_string(i) + "\"",
+                         engine->stats());
+
+  auto per_loop = [&](std::string_view name, std::string_view type,
+                      std::string_view help, auto value) {
+    text.family(name, type, help);
+    for (const auto &[labels, io] : loops)
+      text.sample(name, labels, value(io));
+  };
+
+  using statistics = coro::io_engine::statistics;
+  per_loop("webserver_loop_pending_operations", "gauge",
+           "Operations waiting for the backend.",
+           [](const statistics &io) {
+             return static_cast<std::uint64_t>(io.pending_operations);
+           });
+  per_loop("webserver_loop_iterations_total", "counter",
+           "Iterations of the event loop.",
+           [](const statistics &io) { return io.iterations; });
+  per_loop("webserver_loop_poll_seconds_total", "counter",
+           "Time spent in the backend (waiting for events included).",
+           [](const statistics &io) { return io.poll_time; });
+  per_loop("webserver_loop_run_queue_depth", "gauge",
+           "Coroutines waiting in the run queue.",
+           [](const statistics &io) {
+             return static_cast<std::uint64_t>(io.run_queue_depth);
+           });
+  per_loop("webserver_loop_lag_seconds", "gauge",
+           "Moving average of how long ready coroutines wait to run.",
+           [](const statistics &io) { return io.loop_lag; });
+
+  text.family("webserver_fast_path_total", "counter",
+              "Optimistic syscalls by operation and whether they completed "
+              "without waiting.");
+  for (const auto &[labels, io] : loops)
+    for (auto [op, counters] : {std::pair{"recv", io.recv},
+                                std::pair{"send", io.send},
+                                std::pair{"accept", io.accept}}) {
+      auto prefix = labels + ",op=\"" + op + "\",result=";
+      text.sample("webserver_fast_path_total", prefix + "\"hit\"",
+                  counters.hits);
+      text.sample("webserver_fast_path_total", prefix + "\"miss\"",
+                  counters.calls - counters.hits);
+    }
+
+  // the caches are shared by the loops
+  struct cache_counts {
+    std::string_view name;
+    std::uint64_t hits, misses, evictions;
+    std::size_t entries;
+  };
+
+  std::vector<cache_counts> caches;
+  if (state.cache) {
+    auto c = state.cache->stats();
+    caches.push_back({"content", c.hits, c.misses, c.evictions, c.entries});
+  }
+  auto f = state.files->stats();
+  caches.push_back({"file", f.hits, f.misses, f.evictions, f.entries});
+  if (state.gzip) {
+    auto g = state.gzip->stats();
+    caches.push_back({"gzip", g.hits, g.misses, g.evictions, g.entries});
+  }
+
+  auto per_cache = [&](std::string_view name, std::string_view type,
+                       std::string_view help, auto member) {
+    text.family(name, type, help);
+    for (const auto &c : caches)
+      text.sample(name, "cache=\"" + std::string(c.name) + "\"",
+                  static_cast<std::uint64_t>(c.*member));
+  };
+
+  per_cache("webserver_cache_hits_total", "counter", "Cache hits.",
+            &cache_counts::hits);
+  per_cache("webserver_cache_misses_total", "counter", "Cache misses.",
+            &cache_counts::misses);
+  per_cache("webserver_cache_evictions_total", "counter", "Cache evictions.",
+            &cache_counts::evictions);
+  per_cache("webserver_cache_entries", "gauge", "Entries in the cache.",
+            &cache_counts::entries);
+
+  return text.str();
+}
+
+http::response metrics_response(const server_state &state, bool keep_alive) {
+  auto body = collect_metrics(state);
+
+  http::response res;
+  res.status = 200;
+  res.head = "HTTP/1.1 200 OK\r\nContent-Type: ";
+  res.head.append(io::metrics_text::content_type);
+  res.head.append("\r\nContent-Length: ");
+  res.head.append(std::to_string(body.size()));
+  res.head.append("\r\nCache-Control: no-store\r\n");
+  if (!keep_alive)
+    res.head.append("Connection: close\r\n");
+  res.head.append("\r\n");
+  res.head.append(body);
+
+  return res;
+}
+
+// when the phases of a request started (tracing only)
+struct request_timing {
+  std::uint64_t parse = 0;
+  std::uint64_t resolve = 0;
+  std::uint64_t build = 0;
+  std::uint64_t done = 0;
+};
 
-  std::string response;
+std::pair<http::response, bool>
+build_response(std::string_view request, const server_state &state,
+               request_timing *timing = nullptr) {
   http::request req;
+  http::response response;
+
+  auto mark = [&](std::uint64_t request_timing::*phase) {
+    if (timing)
+      timing->*phase = io::trace_ring::now();
+  };
 
   try {
-    req = get_request_data(request, directory);
-    response = http::get_response("HTTP/1.1", req);
+    mark(&request_timing::parse);
+
+    // request format: <method> <path> <version>\r\n<headers>\r\n
+    http::parsed_request parsed;
+    bool valid = http::parse_request(request, parsed);
+
+    mark(&request_timing::resolve);
+    if (valid && state.metrics && parsed.method == "GET" &&
+        parsed.target == metrics_path) {
+      req.keep_alive = parsed.find("Connection") != "close";
+
+      mark(&request_timing::build);
+      response = metrics_response(state, req.keep_alive);
+    } else {
+      req = valid ? get_request_data(parsed, state) : http::request{};
+
+      mark(&request_timing::build);
+      response = http::get_response("HTTP/1.1", req, state.cache);
+    }
   } catch (...) {
     // send internal server error instead
     req = {http::r500{}};
     response = http::get_response("HTTP/1.1", req);
   }
 
-  co_await io::send_all(engine, sock, response);
-  co_return req.keep_alive;
+  mark(&request_timing::done);
+  return {std::move(response), req.keep_alive};
 }
 
-coro::async_generator<char> socket_stream(coro::io_engine &engine,
-                                          const utils::handle &sock,
-                                          auto timeout_duration) {
-  while (true) {
-    if (co_await engine.poll_for(sock, POLLIN, timeout_duration) == 0)
-      co_return;
+// pipelined requests answered together
+constexpr std::size_t max_batch = 32;
 
-    char buffer[1024];
-    ssize_t bytes_read = recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT);
+// connections accepted before the listener lets the others run
+constexpr std::size_t accept_batch = 64;
 
-    if (bytes_read < 0) {
-      if (errno == EWOULDBLOCK)
-        continue;
-      utils::throw_sys_error("recv");
+coro::lazy_task<bool> handle_requests(
+  coro::io_engine &engine,
+  const utils::handle &sock,
+  std::span<const std::string_view> requests,
+  worker_stats &stats,
+  const server_state &state,
+  io::trace_ring *trace,
+  std::uint32_t connection,
+  std::uint32_t client,
+  std::chrono::steady_clock::time_point head_start) {
+
+  // responses in request order, none after the one that closes the
+  //  connection
+  std::vector<std::pair<http::response, bool>> responses;
+  responses.reserve(requests.size());
+
+  // filled wherever the responses are built, recorded on the loop
+  std::vector<request_timing> timings(trace ? requests.size() : 0);
+
+  auto build_all = [&] {
+    for (auto request : requests) {
+      auto *timing = trace ? &timings[responses.size()] : nullptr;
+      responses.push_back(build_response(request, state, timing));
+      if (!responses.back().second)
+        break;
     }
+  };
 
-    for (int i = 0; i < bytes_read; ++i)
-      co_yield buffer[i];
+  // building the responses (reading the files) is moved off the event loop
+  //  if we have a pool
+  if (state.pool)
+    co_await coro::offload(*state.pool, engine, build_all);
+  else
+    build_all();
+
+  stats.requests.fetch_add(responses.size(), std::memory_order_relaxed);
+  for (const auto &response : responses)
+    stats.count_response(response.first.status);
+
+  std::uint64_t send_start = 0;
+  if (trace) {
+    for (std::size_t i = 0; i < responses.size(); ++i) {
+      const auto &t = timings[i];
+      // phases after an exception were skipped
+      auto end_of = [&](std::uint64_t next) { return next ? next : t.done; };
+
+      trace->record("parse", t.parse, end_of(t.resolve), connection);
+      if (t.resolve)
+        trace->record("resolve", t.resolve, end_of(t.build), connection);
+      if (t.build)
+        trace->record("build", t.build, t.done, connection);
+    }
+
+    send_start = io::trace_ring::now();
   }
+
+  // bytes sent, the span of the whole batch and its access log lines,
+  //  however it ends
+  struct send_totals {
+    worker_stats &stats;
+    io::trace_ring *trace;
+    std::uint64_t start;
+    std::uint32_t connection;
+    std::uint32_t count;
+    std::uint64_t sent = 0;
+
+    http::access_log *log;
+    std::span<const std::string_view> requests;
+    std::span<const std::pair<http::response, bool>> responses;
+    std::uint32_t client;
+    std::chrono::steady_clock::time_point head_start;
+
+    ~send_totals() {
+      stats.sent.fetch_add(sent, std::memory_order_relaxed);
+      if (trace)
+        trace->record("send", start, io::trace_ring::now(), connection, count);
+      if (log)
+        log->log_batch(client, requests, responses, sent, head_start);
+    }
+  } sending{stats,
+            trace,
+            send_start,
+            connection,
+            static_cast<std::uint32_t>(responses.size()),
+            0,
+            state.log,
+            requests,
+            responses,
+            client,
+            head_start};
+
+  // heads and bodies of all responses go out with one sendmsg, files (or
+  //  their ranges) are sent with sendfile in between
+  std::vector<iovec> buffers;
+  buffers.reserve(2 * responses.size());
+  std::size_t buffered = 0;
+
+  auto add = [&](std::string_view data) {
+    if (!data.empty())
+      buffers.push_back({const_cast<char *>(data.data()), data.size()});
+    buffered += data.size();
+  };
+
+  for (const auto &[data, keep_alive] : responses) {
+    add(data.head);
+    add(data.body);
+
+    for (const auto &part : data.parts) {
+      add(part.prefix);
+
+      // the head goes out in one segment with the start of the file (alone
+      //  Nagle would hold the file back until the client ACKs the head)
+      int more = part.length > 0 ? MSG_MORE : 0;
+
+      // the client went away, close the connection
+      if (co_await io::send_all(engine, sock, buffers, more))
+        co_return false;
+      buffers.clear();
+      sending.sent += std::exchange(buffered, 0);
+
+      if (co_await io::send_file(engine, sock, data.file->fd, part.offset,
+                                 part.length))
+        co_return false;
+      sending.sent += part.length;
+    }
+
+    add(data.tail);
+  }
+
+  if (co_await io::send_all(engine, sock, buffers))
+    co_return false;
+  sending.sent += buffered;
+
+  co_return responses.back().second;
+}
+
+// gives a connection slot back and wakes the listeners parked at the cap
+//  (seq_cst pairs with the check of a parking listener)
+void release_connection(const server_state &state) {
+  if (state.connections->fetch_sub(1) > state.max_connections)
+    return;
+
+  for (auto &parked : state.listeners)
+    if (parked.handle.load() != nullptr)
+      if (void *handle = parked.handle.exchange(nullptr))
+        parked.engine->post(std::coroutine_handle<>::from_address(handle));
+}
+
+// suspends the listener while the connections are at the cap (retained,
+//  so that its loop keeps running until a connection posts it back)
+auto below_connection_cap(parked_listener &parked, const server_state &state) {
+  struct awaiter {
+    parked_listener &parked;
+    const server_state &state;
+
+    bool at_cap() const {
+      return state.connections->load() >= state.max_connections;
+    }
+
+    bool await_ready() const { return !at_cap(); }
+    bool await_suspend(std::coroutine_handle<> handle) {
+      parked.engine->retain();
+      retained = true;
+      parked.handle.store(handle.address());
+
+      // a slot freed before the store did not see us, unless it took the
+      //  handle we have to wait for its post
+      return at_cap() || parked.handle.exchange(nullptr) == nullptr;
+    }
+
+    // back on the loop (posted or never suspended)
+    void await_resume() {
+      if (retained)
+        parked.engine->release();
+    }
+
+    bool retained = false;
+  };
+
+  return awaiter{parked, state};
 }
 
 coro::task handle_client(coro::io_engine &engine, utils::handle sock,
-                         std::filesystem::path directory, int request_id) try {
+                         int request_id, worker_stats &stats,
+                         const server_state &state,
+                         io::buffer_pool &buffers,
+                         io::trace_ring *trace) try {
+  using clock = std::chrono::steady_clock;
+
+  // gives the slot taken by the listener back however the task ends
+  struct connection_slot {
+    const server_state &state;
+    worker_stats &stats;
+    ~connection_slot() {
+      release_connection(state);
+      stats.closed.fetch_add(1, std::memory_order_relaxed);
+    }
+  } slot{state, stats};
 
   if (utils::debug_mode)
     std::cout << "New connection (" << request_id << ") -> fd = " << (int)sock
               << "\n";
 
-  std::string request;
+  // unconsumed data is at the start of the buffer
+  io::buffer_pool::buffer buffer;
+  std::size_t filled = 0;
+  auto header_deadline = clock::time_point::max();
+  bool keep_alive = true;
+
+  // since when the request heads in the buffer were coming in
+  auto head_start = clock::time_point();
 
-  auto stream = socket_stream(engine, sock, std::chrono::seconds(15));
-  auto end = stream.end();
-  for (auto it = co_await stream.begin(); it != end; co_await ++it) {
-    request.push_back(*it);
-    if (request.ends_with("\r\n\r\n")) {
-      if (!co_await handle_request(engine, sock, request, directory))
+  // IPv4 address of the client for the access log
+  std::uint32_t client = 0;
+  if (state.log) {
+    sockaddr_in address{};
+    socklen_t length = sizeof(address);
+    if (getpeername(sock, reinterpret_cast<sockaddr *>(&address), &length) ==
+            0 &&
+        address.sin_family == AF_INET)
+      client = address.sin_addr.s_addr;
+  }
+
+  while (keep_alive) {
+    // idle connections wait for the next request without a buffer
+    if (filled == 0) {
+      buffer = {};
+
+      auto ready = co_await engine.try_poll_until(
+          sock, POLLIN, clock::now() + state.idle_timeout);
+      if (!ready || !(*ready & POLLIN))
         break;
 
-      request.clear();
+      buffer = buffers.acquire();
+      head_start = clock::now();
+      header_deadline = head_start + state.header_timeout;
+    }
+
+    auto space = buffer.span().subspan(filled);
+
+    // the head of the request does not fit into the buffer
+    if (space.empty()) {
+      auto response =
+          http::get_response("HTTP/1.1", http::request{http::r431{}, false});
+      stats.count_response(response.status);
+      co_await io::send_all(engine, sock, response.head);
+
+      // logged without a request line (it may be incomplete)
+      if (state.log)
+        state.log->log(client, {}, response.status, response.head.size(),
+                       clock::now() - head_start,
+                       std::chrono::system_clock::now());
+      break;
+    }
+
+    // slow request heads are cut off at the deadline (however the data
+    //  trickles in)
+    auto bytes_read = co_await engine.try_async_recv(
+        sock, std::as_writable_bytes(space), header_deadline);
+
+    // error, timeout or connection closed
+    if (!bytes_read || !*bytes_read || **bytes_read == 0)
+      break;
+
+    // the terminator may span the previous read
+    std::size_t scan_from = filled < 3 ? 0 : filled - 3;
+    filled += **bytes_read;
+    std::string_view data(buffer.span().data(), filled);
+
+    // a read may contain several (pipelined) requests, they are answered
+    //  in batches
+    std::size_t consumed = 0;
+    std::size_t header_end;
+    while (keep_alive && (header_end = http::find_header_end(
+                              data, scan_from)) != std::string::npos) {
+      std::array<std::string_view, max_batch> batch;
+      std::size_t count = 0;
+
+      do {
+        batch[count++] = data.substr(consumed, header_end - consumed);
+        consumed = header_end;
+      } while (count < max_batch &&
+               (header_end = http::find_header_end(data, consumed)) !=
+                   std::string::npos);
+
+      if (trace)
+        trace->record("recv", io::trace_ring::ticks(head_start),
+                      io::trace_ring::now(), request_id, count);
+
+      keep_alive = co_await handle_requests(
+          engine, sock, std::span(batch.data(), count), stats, state, trace,
+          request_id, client, head_start);
+      scan_from = consumed;
+
+      auto end = clock::now();
+      stats.latency.record(end - head_start, count);
+      if (trace)
+        trace->record("request", io::trace_ring::ticks(head_start),
+                      io::trace_ring::ticks(end), request_id, count);
+
+      // pipelined requests behind the batch are already here
+      head_start = end;
+    }
+
+    // the rest is the start of the next request
+    if (consumed > 0) {
+      std::memmove(buffer.span().data(), data.data() + consumed,
+                   filled - consumed);
+      filled -= consumed;
+      header_deadline = clock::now() + state.header_timeout;
     }
   }
 
@@ -185,18 +780,227 @@ coro::task handle_client(coro::io_engine &engine, utils::handle sock,
   std::cout << "Exception in handle_client (" << request_id << '\n';
 }
 
-} // namespace
+coro::task print_stats(coro::io_engine &engine,
+                       std::span<const worker_stats> stats,
+                       const server_state &state,
+                       std::chrono::milliseconds interval) {
+  while (true) {
+    co_await engine.wait_for(interval);
 
-coro::task server_listener(coro::io_engine &engine, int argc,
-                           char *argv[]) try {
-  io::input_data data = io::parse_input(argc, argv);
-  utils::debug_mode = data.debug_mode;
+    for (std::size_t i = 0; i < stats.size(); ++i) {
+      std::cout << "Thread " << i << ": accepted "
+                << stats[i].accepted.load(std::memory_order_relaxed)
+                << ", requests "
+                << stats[i].requests.load(std::memory_order_relaxed)
+                << ", shed " << stats[i].shed.load(std::memory_order_relaxed);
+
+      if (auto *other = stats[i].engine.load(std::memory_order_acquire)) {
+        using std::chrono::microseconds;
+        auto current = other->stats();
+        std::cout << ", run queue " << current.run_queue_depth << " (peak "
+                  << current.peak_run_queue_depth << "), loop lag "
+                  << std::chrono::duration_cast<microseconds>(current.loop_lag)
+                         .count()
+                  << "us (max "
+                  << std::chrono::duration_cast<microseconds>(
+                         current.max_loop_lag)
+                         .count()
+                  << "us)";
+      }
+
+      if (auto *buffers = stats[i].buffers.load(std::memory_order_acquire)) {
+        auto current = buffers->stats();
+        std::cout << ", buffers " << current.in_use << " in use (peak "
+                  << current.peak_in_use << ", "
+                  << current.in_use * buffers->buffer_size() << " bytes), "
+                  << current.cached << " cached";
+      }
+
+      std::cout << '\n';
+    }
+
+    std::cout << "Connections: "
+              << state.connections->load(std::memory_order_relaxed) << " of "
+              << state.max_connections << '\n';
+
+    if (state.log) {
+      auto log = state.log->stats();
+      std::cout << "Access log: " << log.written << " written, "
+                << log.dropped << " dropped\n";
+    }
+
+    coro::io_engine::statistics io;
+    for (const auto &s : stats) {
+      auto *other = s.engine.load(std::memory_order_acquire);
+      if (!other)
+        continue;
+
+      auto add = [](auto &to, const auto &from) {
+        to.calls += from.calls;
+        to.hits += from.hits;
+      };
+
+      auto current = other->stats();
+      add(io.recv, current.recv);
+      add(io.send, current.send);
+      add(io.accept, current.accept);
+    }
+
+    std::cout << "Fast path hit rate: recv " << io.recv.hit_rate() * 100
+              << "% of " << io.recv.calls << ", send "
+              << io.send.hit_rate() * 100 << "% of " << io.send.calls
+              << ", accept " << io.accept.hit_rate() * 100 << "% of "
+              << io.accept.calls << '\n';
+
+    if (auto *cache = state.cache) {
+      auto content = cache->stats();
+      std::cout << "Content cache: " << content.hits << " hits, "
+                << content.misses << " misses, " << content.evictions
+                << " evictions, " << content.invalidations
+                << " invalidations, " << content.entries << " entries ("
+                << content.bytes << " bytes)\n";
+    }
+
+    auto files = state.files->stats();
+    std::cout << "File cache: " << files.hits << " hits, "
+              << files.revalidations << " revalidations, " << files.misses
+              << " misses, " << files.evictions << " evictions, "
+              << files.entries << " entries\n";
+
+    if (auto *gzip = state.gzip) {
+      auto compressed = gzip->stats();
+      std::cout << "Gzip cache: " << compressed.hits << " hits, "
+                << compressed.misses << " misses, " << compressed.evictions
+                << " evictions, " << compressed.entries << " entries ("
+                << compressed.bytes << " bytes)\n";
+    }
+
+    auto frames = coro::frame_pool::stats();
+    std::cout << "Coroutine frames: " << frames.allocations
+              << " allocations, pool hit rate " << frames.hit_rate() * 100
+              << "%, " << frames.heap_allocations << " from heap, peak "
+              << frames.peak_bytes << " bytes\n";
+  }
+}
+
+// invalidate cache entries of files that changed (inotify is set up by
+//  the cache for the directories of cached files)
+coro::task watch_content_cache(coro::io_engine &engine,
+                               const utils::handle &notify,
+                               http::content_cache &cache) try {
+  while (true) {
+    auto ready = co_await engine.try_poll(notify, POLLIN);
+    if (!ready) {
+      std::cout << "Content cache watch failed: " << ready.error().message()
+                << '\n';
+      co_return;
+    }
+
+    cache.process_notifications();
+  }
+} catch (const std::exception &e) {
+  std::cout << "Exception in watch_content_cache: " << e.what() << '\n';
+}
+
+// write the spans of all loops to trace-<pid>-<n>.json whenever SIGUSR1
+//  arrives (the loop is blocked while the file is written)
+coro::task dump_traces(coro::io_engine &engine, const utils::handle &signals,
+                       std::span<const worker_stats> stats) try {
+  for (unsigned dump = 0;; ++dump) {
+    auto ready = co_await engine.try_poll(signals, POLLIN);
+    if (!ready) {
+      std::cout << "Trace signal watch failed: " << ready.error().message()
+                << '\n';
+      co_return;
+    }
+
+    signalfd_siginfo info;
+    while (read(signals, &info, sizeof(info)) == sizeof(info))
+      ;
+
+    std::vector<std::vector<io::trace_ring::span>> loops;
+    std::size_t spans = 0;
+    for (const auto &s : stats) {
+      auto *trace = s.trace.load(std::memory_order_acquire);
+      loops.push_back(trace ? trace->snapshot()
+                            : std::vector<io::trace_ring::span>{});
+      spans += loops.back().size();
+    }
+
+    auto path = "trace-" + std::to_string(getpid()) + "-" +
+                std::to_string(dump) + ".json";
+    std::ofstream out(path);
+    io::write_chrome_trace(out, loops);
+
+    if (out.flush())
+      std::cout << "Trace of " << spans << " spans written to " << path
+                << '\n';
+    else
+      std::cout << "Cannot write trace to " << path << '\n';
+  }
+} catch (const std::exception &e) {
+  std::cout << "Exception in dump_traces: " << e.what() << '\n';
+}
+
+// answer a new connection with a canned 503 and close it (no task, no
+//  operation in the engine), the request is drained first if it is already
+//  there so that closing does not reset the connection under the response
+void reject_overloaded(const utils::handle &sock) {
+  static const std::string response =
+      http::get_response("HTTP/1.1", http::request{http::r503{}, false}).head;
+
+  std::array<char, 2048> scratch;
+  while (recv(sock, scratch.data(), scratch.size(), MSG_DONTWAIT) > 0)
+    ;
+
+  send(sock, response.data(), response.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+  shutdown(sock, SHUT_WR);
+}
+
+// pin the calling thread to the n-th cpu it is allowed to run on
+void pin_thread(unsigned n) {
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+    return;
+
+  unsigned count = CPU_COUNT(&allowed);
+  if (count == 0)
+    return;
+
+  n %= count;
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (!CPU_ISSET(cpu, &allowed) || n-- != 0)
+      continue;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    return;
+  }
+}
 
+} // namespace
+
+coro::task server_listener(coro::io_engine &engine, const io::input_data &data,
+                           worker_stats &stats, const server_state &state,
+                           io::buffer_pool &buffers,
+                           io::trace_ring *trace,
+                           parked_listener &parked) try {
   utils::handle server_socket(socket(AF_INET, SOCK_STREAM, 0));
 
   if (!server_socket)
     utils::throw_sys_error("socket");
 
+  // every event loop has its own listening socket, the kernel spreads
+  //  incoming connections between them
+  if (data.threads > 1) {
+    int one = 1;
+    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &one,
+                   sizeof(one)) < 0)
+      utils::throw_sys_error("setsockopt(SO_REUSEPORT)");
+  }
+
   sockaddr_in addr;
   addr.sin_family = AF_INET;
   addr.sin_port = data.port;
@@ -206,7 +1010,7 @@ coro::task server_listener(coro::io_engine &engine, int argc,
       0)
     utils::throw_sys_error("bind");
 
-  if (listen(server_socket, 5) < 0)
+  if (listen(server_socket, data.backlog) < 0)
     utils::throw_sys_error("listen");
 
   // set no-block
@@ -218,25 +1022,52 @@ coro::task server_listener(coro::io_engine &engine, int argc,
     utils::throw_sys_error("fcntl");
 
   int request_count = 0;
-
-  if (data.inspirational_quotes)
-    io::quote_generator(engine, data.quote_interval);
+  std::size_t batch = 0;
 
   while (true) {
-    co_await engine.poll(server_socket, POLLIN);
+    // at the cap new connections wait in the backlog until a connection
+    //  (on any loop) closes
+    while (state.connections->load() >= state.max_connections)
+      co_await below_connection_cap(parked, state);
+
+    // the queue is drained in batches (accepts that do not block complete
+    //  right away), then the accepted connections get to run
+    if (++batch == accept_batch) {
+      batch = 0;
+      co_await engine.schedule();
+    }
+
+    auto client_socket = co_await engine.try_async_accept(server_socket);
 
-    utils::handle client_socket(
-        accept4(server_socket, nullptr, nullptr, SOCK_NONBLOCK));
+    // the connection may have been reset before we got to it
     if (!client_socket) {
-      if (errno == EAGAIN)
-        continue;
-      utils::throw_sys_error("accept4");
+      if (utils::debug_mode)
+        std::cout << "accept failed: " << client_socket.error().message()
+                  << '\n';
+
+      // out of fds, retrying right away would spin
+      auto err = client_socket.error();
+      if (err == std::errc::too_many_files_open ||
+          err == std::errc::too_many_files_open_in_system)
+        co_await engine.wait_for(std::chrono::milliseconds(10));
+      continue;
+    }
+
+    stats.accepted.fetch_add(1, std::memory_order_relaxed);
+
+    // shedding has to stay cheaper than serving
+    if (state.shed_lag.count() > 0 && engine.loop_lag() > state.shed_lag) {
+      reject_overloaded(*client_socket);
+      stats.shed.fetch_add(1, std::memory_order_relaxed);
+      stats.count_response(503);
+      continue;
     }
 
     if (utils::debug_mode)
       std::cout << "New connection\n";
-    handle_client(engine, std::move(client_socket), data.directory,
-                  request_count++);
+    state.connections->fetch_add(1, std::memory_order_relaxed);
+    handle_client(engine, std::move(*client_socket), request_count++, stats,
+                  state, buffers, trace);
   }
 
 } catch (const std::exception &e) {
@@ -246,7 +1077,124 @@ coro::task server_listener(coro::io_engine &engine, int argc,
 }
 
 int main(int argc, char *argv[]) {
-  coro::io_engine engine;
-  server_listener(engine, argc, argv);
-  engine.pull_all();
+  io::input_data data = io::parse_input(argc, argv);
+  utils::debug_mode = data.debug_mode;
+
+  std::vector<worker_stats> stats(data.threads);
+
+  // SIGUSR1 is read from a signalfd by the first loop (blocked before any
+  //  other thread is started, they inherit the mask)
+  utils::handle signals;
+  if (data.trace_spans > 0) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    if (pthread_sigmask(SIG_BLOCK, &mask, nullptr) != 0)
+      utils::throw_sys_error("pthread_sigmask");
+
+    signals = utils::handle(signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC));
+    if (!signals)
+      utils::throw_sys_error("signalfd");
+  }
+
+  // shared by all event loops
+  http::host_roots roots(data.directory);
+  std::atomic<std::size_t> connections = 0;
+  std::vector<parked_listener> listeners(data.threads);
+  server_state state{.roots = &roots,
+                     .header_timeout = data.header_timeout,
+                     .idle_timeout = data.idle_timeout,
+                     .connections = &connections,
+                     .max_connections = data.max_connections,
+                     .shed_lag = data.shed_lag,
+                     .listeners = listeners,
+                     .workers = stats,
+                     .metrics = data.metrics};
+
+  // created before the event loops so that it outlives them (the writer
+  //  flushes what is left when it is destroyed)
+  std::optional<http::access_log> log;
+  if (!data.access_log.empty()) {
+    log.emplace(data.access_log, data.log_format);
+    state.log = &*log;
+  }
+
+  std::optional<coro::thread_pool> pool;
+  if (data.workers > 0) {
+    pool.emplace(data.workers);
+    state.pool = &*pool;
+  }
+
+  http::file_cache files(http::mime_type_of, data.open_files);
+  state.files = &files;
+
+  std::optional<http::gzip_cache> gzip;
+  if (data.gzip_cache_size > 0) {
+    gzip.emplace(data.gzip_cache_size);
+    state.gzip = &*gzip;
+  }
+
+  utils::handle notify;
+  std::optional<http::content_cache> cache;
+  if (data.cache_size > 0) {
+    notify = utils::handle(inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+    if (!notify)
+      utils::throw_sys_error("inotify_init1");
+
+    cache.emplace(data.cache_size, notify);
+    state.cache = &*cache;
+  }
+
+  auto run_worker = [&](unsigned id) {
+    // outlive the connections (destroyed with the engine)
+    io::buffer_pool buffers(data.max_header_size);
+    stats[id].buffers.store(&buffers, std::memory_order_release);
+
+    std::optional<io::trace_ring> trace;
+    if (data.trace_spans > 0) {
+      trace.emplace(data.trace_spans);
+      stats[id].trace.store(&*trace, std::memory_order_release);
+    }
+
+    coro::io_engine engine(data.backend);
+    stats[id].engine.store(&engine, std::memory_order_release);
+
+    if (utils::debug_mode && id == 0)
+      std::cout << "Using " << coro::to_string(engine.get_backend())
+                << " backend\n";
+
+    listeners[id].engine = &engine;
+    server_listener(engine, data, stats[id], state, buffers,
+                    trace ? &*trace : nullptr, listeners[id]);
+
+    if (id == 0 && cache)
+      watch_content_cache(engine, notify, *cache);
+
+    if (id == 0 && data.inspirational_quotes)
+      io::quote_generator(engine, data.quote_interval);
+
+    if (id == 0 && data.print_stats)
+      print_stats(engine, stats, state, data.stats_interval);
+
+    if (id == 0 && signals)
+      dump_traces(engine, signals, stats);
+
+    engine.pull_all();
+    stats[id].engine.store(nullptr, std::memory_order_release);
+    stats[id].buffers.store(nullptr, std::memory_order_release);
+    stats[id].trace.store(nullptr, std::memory_order_release);
+  };
+
+  if (data.threads == 1) {
+    run_worker(0);
+    return 0;
+  }
+
+  // one event loop per thread, nothing is shared on the request path
+  std::vector<std::jthread> workers;
+  for (unsigned id = 0; id < data.threads; ++id)
+    workers.emplace_back([&, id] {
+      pin_thread(id);
+      run_worker(id);
+    });
 }
\ No newline at end of file